@@ -52,6 +52,7 @@ global irq15
 global isr128
 extern isr_handler
 extern irq_handler
+global switch_to
 
 %macro isr_no_error 1
 global isr%1
@@ -128,6 +129,12 @@ irq_stub 12, 44
 irq_stub 13, 45
 irq_stub 14, 46
 irq_stub 15, 47
+; Local APIC vectors: timer, IPIs and spurious
+irq_stub 240, 240
+irq_stub 241, 241
+irq_stub 242, 242
+irq_stub 244, 244
+irq_stub 255, 255
 
 isr_common_stub:
     ; Save CPU state (64-bit registers)
@@ -211,4 +218,26 @@ irq_common_stub:
     pop r15
 
     add rsp, 16
-    iretq
\ No newline at end of file
+    iretq
+
+; void switch_to(uint64_t* prev_rsp, uint64_t next_rsp)
+; Saves the callee-saved registers on the current stack, stores the stack
+; pointer in *prev_rsp and resumes the stack at next_rsp. Everything else
+; was saved by the C caller or is in the trap frame further up that stack.
+; A new task's stack is seeded with the same layout by task_alloc.
+switch_to:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
\ No newline at end of file
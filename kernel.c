@@ -6,7 +6,6 @@
 #include <stdarg.h>
 #include <stdlib.h>
 extern void syscall_handler(registers_t *r);
-extern registers_t* schedule(registers_t *r);
 extern void window_handle_key(char key);
 extern void shell_handle_input(char c);
 extern void dirty_rect_add(int x, int y, int width, int height);
@@ -23,17 +22,60 @@ struct screen_info screen_info = {0};
 // ==========================================
 // FILE: lib.c (Standard Library Helpers)
 // ==========================================
+// memset/memcpy are picked once at boot from CPUID (string_init). Until
+// then the rep movsq/stosq versions run, which work on any x86_64. The
+// variants themselves live in memops.c.
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_movsq;
+static void* (*memset_impl)(void*, int, size_t) = memset_stosq;
+static bool string_use_nt = false;
+static const char* string_impl = "movsq";
+
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx, max_leaf;
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    bool sse2 = (edx >> 26) & 1;
+    bool erms = false;
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        erms = (ebx >> 9) & 1;
+    }
+    if (erms) {
+        memcpy_impl = memcpy_erms;
+        memset_impl = memset_erms;
+        string_impl = sse2 ? "erms+nt" : "erms";
+    } else if (sse2) {
+        string_impl = "movsq+nt";
+    }
+    string_use_nt = sse2;
+}
+
+const char* string_impl_name(void) {
+    return string_impl;
+}
+
+// Clears a page without pulling it into the cache
+void clear_page_nt(void* page) {
+    if (string_use_nt) memset_nt(page, 0, PAGE_SIZE);
+    else memset_impl(page, 0, PAGE_SIZE);
+}
+
 void* memset(void* ptr, int value, size_t num) {
-    unsigned char* p = (unsigned char*)ptr;
-    while (num--) *p++ = (unsigned char)value;
-    return ptr;
+    if (string_use_nt && num >= MEMOPS_NT_THRESHOLD) return memset_nt(ptr, value, num);
+    return memset_impl(ptr, value, num);
 }
 
 void* memcpy(void* dest, const void* src, size_t num) {
-    unsigned char* d = (unsigned char*)dest;
-    const unsigned char* s = (const unsigned char*)src;
-    while (num--) *d++ = *s++;
-    return dest;
+    if (string_use_nt && num >= MEMOPS_NT_THRESHOLD) return memcpy_nt(dest, src, num);
+    return memcpy_impl(dest, src, num);
+}
+
+void* memmove(void* dest, const void* src, size_t num) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    // A forward copy is safe unless dest starts inside the source
+    if (d <= s || d >= s + num) return memcpy_impl(dest, src, num);
+    return memcpy_backward(dest, src, num);
 }
 
 size_t strlen(const char* str) {
@@ -42,6 +84,23 @@ size_t strlen(const char* str) {
     return len;
 }
 
+int strcmp(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (uint8_t)*a - (uint8_t)*b;
+}
+
+int memcmp(const void* a, const void* b, size_t num) {
+    const uint8_t* p = (const uint8_t*)a;
+    const uint8_t* q = (const uint8_t*)b;
+    for (size_t i = 0; i < num; i++) {
+        if (p[i] != q[i]) return p[i] - q[i];
+    }
+    return 0;
+}
+
 // NOTE: Simple heap disabled in favor of heap.c
 // #define HEAP_SIZE 1024 * 1024 
 // static uint8_t heap_memory[HEAP_SIZE];
@@ -317,35 +376,74 @@ const uint8_t font[256][16] = {
 // ==========================================
 // FILE: gdt.c
 // ==========================================
-#define GDT_ENTRIES 5
-static struct gdt_entry gdt[GDT_ENTRIES];
-static struct gdt_ptr gp;
+#define GDT_ENTRIES 7     // 5 segments + a 16-byte TSS descriptor
+#define TSS_SELECTOR 0x28
+#define IST_STACK_SIZE 8192
+// Every CPU has its own GDT (its TSS descriptor's busy bit is per CPU), TSS and IST stacks.
+static struct gdt_entry gdt[MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr gp[MAX_CPUS];
+static struct tss_entry tss[MAX_CPUS];
+// Page faults and double faults run on their own stacks so a kernel stack
+// overflow into its guard page is still reported.
+static uint8_t ist_stacks[MAX_CPUS][2][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+cpu_t cpus[MAX_CPUS];
+uint32_t nr_cpus_online = 1;
+
+void gdt_set_gate(struct gdt_entry* table, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    table[num].base_low = (base & 0xFFFF);
+    table[num].base_middle = (base >> 16) & 0xFF;
+    table[num].base_high = (base >> 24) & 0xFF;
+    table[num].limit_low = (limit & 0xFFFF);
+    table[num].granularity = ((limit >> 16) & 0x0F);
+    table[num].granularity |= (gran & 0xF0);
+    table[num].access = access;
+}
+
+// Loads cpu's GDT and TSS and points GS at its cpu_t.
+void gdt_install_cpu(uint32_t cpu) {
+    struct gdt_entry* table = gdt[cpu];
+    gp[cpu].limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    gp[cpu].base = (uint64_t)table;
+
+    gdt_set_gate(table, 0, 0, 0, 0, 0);                    
+    // 0xAF = 10101111b (Granularity=1, LongMode=1, Present=1, Limit=F)
+    gdt_set_gate(table, 1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Kernel Code (64-bit)
+    gdt_set_gate(table, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Kernel Data
+    gdt_set_gate(table, 3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User Code
+    gdt_set_gate(table, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User Data
+
+    gdt_flush(&gp[cpu]);
+    tss_install(cpu);
 
-void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-    gdt[num].base_low = (base & 0xFFFF);
-    gdt[num].base_middle = (base >> 16) & 0xFF;
-    gdt[num].base_high = (base >> 24) & 0xFF;
-    gdt[num].limit_low = (limit & 0xFFFF);
-    gdt[num].granularity = ((limit >> 16) & 0x0F);
-    gdt[num].granularity |= (gran & 0xF0);
-    gdt[num].access = access;
+    // Loading GS above cleared its base; set it after
+    cpus[cpu].self = &cpus[cpu];
+    cpus[cpu].id = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)&cpus[cpu]);
 }
 
 void gdt_install(void) {
-    gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
-    gp.base = (uint64_t)&gdt;
+    gdt_install_cpu(0);
+}
 
-    gdt_set_gate(0, 0, 0, 0, 0);                    
-    // 0xAF = 10101111b (Granularity=1, LongMode=1, Present=1, Limit=F)
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Kernel Code (64-bit)
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Kernel Data
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User Code
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User Data
+void tss_install(uint32_t cpu) {
+    struct tss_entry* t = &tss[cpu];
+    memset(t, 0, sizeof(*t));
+    t->ist[IST_PAGE_FAULT - 1] = (uint64_t)&ist_stacks[cpu][0][IST_STACK_SIZE];
+    t->ist[IST_DOUBLE_FAULT - 1] = (uint64_t)&ist_stacks[cpu][1][IST_STACK_SIZE];
+    t->iomap_base = sizeof(*t);
 
-    gdt_flush();
+    // 64-bit TSS descriptor: a system segment spanning two GDT slots
+    uint64_t base = (uint64_t)t;
+    gdt_set_gate(gdt[cpu], 5, (uint32_t)base, sizeof(*t) - 1, 0x89, 0x00);
+    memset(&gdt[cpu][6], 0, sizeof(struct gdt_entry));
+    gdt[cpu][6].limit_low = (base >> 32) & 0xFFFF;
+    gdt[cpu][6].base_low = (base >> 48) & 0xFFFF;
+
+    __asm__ __volatile__("ltr %w0" : : "r"(TSS_SELECTOR));
 }
 
-void gdt_flush(void) {
+void gdt_flush(struct gdt_ptr* ptr) {
     __asm__ __volatile__ (
         "lgdt %0\n\t"
         "mov $0x10, %%ax\n\t"
@@ -354,9 +452,15 @@ void gdt_flush(void) {
         "mov %%ax, %%fs\n\t"
         "mov %%ax, %%gs\n\t"
         "mov %%ax, %%ss\n\t"
-        // No far jump needed in 64-bit if CS is already 0x08 from entry
+        // Reload CS: APs arrive on the trampoline's 0x18, which is user
+        // code in this GDT and would fault on the first iretq
+        "pushq $0x08\n\t"
+        "leaq 1f(%%rip), %%rax\n\t"
+        "pushq %%rax\n\t"
+        "lretq\n"
+        "1:"
         :
-        : "m"(gp)
+        : "m"(*ptr)
         : "rax", "memory"
     );
 }
@@ -417,6 +521,11 @@ extern void irq12(void);
 extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
+extern void irq240(void);
+extern void irq241(void);
+extern void irq242(void);
+extern void irq244(void);
+extern void irq255(void);
 // Exception messages
 static const char *exception_messages[] = {
     "Division By Zero", "Debug", "Non Maskable Interrupt", "Breakpoint",
@@ -481,6 +590,8 @@ void irq_install_handler(int irq, isr_t handler) {
 }
 
 registers_t* irq_handler(registers_t *r) {
+    // Any interrupt, IPIs included, ends a stopped tick
+    tick_nohz_irq_enter(r);
     if (interrupt_handlers[r->int_no]) {
         isr_t handler = interrupt_handlers[r->int_no];
         return handler(r);
@@ -495,6 +606,8 @@ registers_t* irq_handler(registers_t *r) {
 
     if (r->int_no >= 40) outb(0xA0, 0x20); // Slave
     outb(0x20, 0x20); // Master
+    // After the EOI: a switch here only returns once this task runs again
+    schedule_irq_exit();
     return r;
 }
 
@@ -569,9 +682,24 @@ void idt_install(void) {
     idt_set_gate(46, (uint64_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint64_t)irq15, 0x08, 0x8E);
     
+    // Local APIC timer and IPIs
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)irq240, 0x08, 0x8E);
+    idt_set_gate(RESCHED_VECTOR, (uint64_t)irq241, 0x08, 0x8E);
+    idt_set_gate(TLB_FLUSH_VECTOR, (uint64_t)irq242, 0x08, 0x8E);
+    idt_set_gate(STOP_VECTOR, (uint64_t)irq244, 0x08, 0x8E);
+    idt_set_gate(SPURIOUS_VECTOR, (uint64_t)irq255, 0x08, 0x8E);
+
     // Syscall
     idt_set_gate(128, (uint64_t)isr128, 0x08, 0xEE);
 
+    idt[8].ist = IST_DOUBLE_FAULT;
+    idt[14].ist = IST_PAGE_FAULT;
+
+    idt_load();
+}
+
+// The IDT is shared; application processors only need to load it.
+void idt_load(void) {
     __asm__ __volatile__("lidt %0" : : "m"(ip));
 }
 
@@ -712,7 +840,7 @@ void init_back_buffer(FrameBuffer* fb) {
     if (g_vram_address != NULL) return;
     
     size_t buffer_size = fb->pitch * fb->height;
-    void* back_buffer = kmalloc(buffer_size);
+    void* back_buffer = vmalloc(buffer_size); // No physically contiguous run needed
     
     if (back_buffer) {
         g_vram_address = fb->address;
@@ -842,41 +970,119 @@ void vga_print_dec(uint32_t n) {
 // --- Memory Management Structures ---
 
 // Physical Page Descriptor
+#define PAGE_FLAG_USED      0x01
+#define PAGE_FLAG_HEAP      0x02  // Backs a TLSF heap pool
+#define PAGE_FLAG_BUDDY     0x04  // Head of a free block on a zone free list
+#define PAGE_FLAG_MOVABLE   0x08  // Reached only through `mapping`; compaction may move it
+#define PAGE_FLAG_KMALLOC   0x10  // Backs a large kmalloc; the head page holds its order
+
+struct Slab;
 typedef struct Page {
-    uint8_t flags;       // 0=Free, 1=Used
+    uint8_t flags;       // PAGE_FLAG_* bits; 0=Free
     uint8_t order;       // Order of the block (valid if head of free block)
     struct Page *next;   // For free lists
     struct Page *prev;   // For free lists
+    struct Slab *slab;   // Owning slab if this page backs a slab cache, else NULL
+    uintptr_t mapping;   // Kernel virtual address of a movable page
 } Page;
 
 // Free List for Buddy System
 typedef struct {
     Page *head;
+    uint32_t nr_free;    // Blocks on this list
 } FreeList;
 
+// Each zone is an independent buddy allocator over a physical range. Zone
+// limits are multiples of the largest block, so buddies never straddle two.
+typedef struct {
+    const char *name;
+    uint32_t start_pfn, end_pfn;   // [start, end) clipped to installed RAM
+    FreeList free_areas[MAX_ORDER];
+    uint32_t managed_pages;        // Pages handed to the buddy at boot
+    uint32_t free_pages;
+    uint32_t watermark_min;        // Only allocations that need this zone go below
+    uint32_t watermark_low;        // Fallbacks from higher zones stop here
+    uint32_t lowmem_reserve;       // Extra pages fallbacks must leave (ISA DMA)
+} Zone;
+
 // SLAB Cache Structures
+#define SLAB_MAX_ORDER      3                 // Slabs span at most 8 pages
+#define SLAB_OBJ_ALIGN      8
+#define SLAB_COLOR_ALIGN    64                // Cache line size used for coloring
+#define SLAB_OFFSLAB_LIMIT  (PAGE_SIZE / 8)   // Objects this large keep their header off-slab
+#define SLAB_OFFSLAB_MAX    64                // Max objects per off-slab slab (sizes the header)
+#define SLAB_FREE_KEEP      1                 // Empty slabs a cache keeps before returning pages
+#define SLAB_FLAG_OFFSLAB   0x1
+#define SLAB_FLAG_NOMAG     0x2               // Bypass the magazine layer (internal caches)
+
+// Magazine layer (Bonwick): per-CPU loaded/previous magazines over a depot
+#define MAG_MAX_ROUNDS      32
+#define MAG_DEFAULT_ROUNDS  15
+
+typedef struct Magazine {
+    struct Magazine *next;
+    uint32_t rounds;
+    void *objs[MAG_MAX_ROUNDS];
+} Magazine;
+
+typedef struct {
+    Magazine *loaded;
+    Magazine *previous;
+    uint64_t allocs, alloc_hits;  // Hits are served without touching the depot
+    uint64_t frees, free_hits;
+} CpuCache;
+
 typedef struct Slab {
-    void *objects;       // Pointer to the actual memory page(s)
+    void *objects;       // First object (after header and color offset)
+    uintptr_t base;      // Start of the backing page block
+    struct Cache *cache; // Owning cache
     uint32_t inuse;      // Count of active objects
     uint32_t free_idx;   // Index of the next free object
     struct Slab *next;
-    // Note: A free-list array usually follows this struct in memory
+    struct Slab *prev;
+    // Note: A uint16_t free-index array follows this struct in memory
 } Slab;
 
 typedef struct Cache {
+    const char *name;
     uint32_t obj_size;
     uint32_t obj_per_slab;
     uint32_t slab_order; // Pages required per slab (2^order)
+    uint32_t flags;
+    uint32_t header_size;  // Bytes reserved at the start of an on-slab slab
+    uint32_t color_range;  // Number of distinct color offsets available
+    uint32_t color_next;   // Color offset for the next slab
+    uint32_t total_slabs;
+    uint32_t free_slabs;
     Slab *slabs_partial;
     Slab *slabs_full;
     Slab *slabs_free;
+    uint32_t active_objs;
+    spinlock_t lock;       // Protects the slab lists
+    void (*ctor)(void *obj);
+    void (*dtor)(void *obj);
+    // Magazine layer
+    uint32_t mag_size;
+    CpuCache cpu[MAX_CPUS];
+    spinlock_t depot_lock;
+    Magazine *depot_full;
+    Magazine *depot_empty;
+    uint32_t depot_full_count;
+    uint32_t depot_empty_count;
+    uint64_t depot_hits;   // Magazine exchanges satisfied by the depot
+    uint64_t slab_allocs;  // Objects that had to come from the slab layer
+    struct Cache *next;    // Global cache chain (for reaping)
 } Cache;
 
 // --- Globals ---
 uintptr_t memblock_cursor;  // Early allocator pointer
 Page *mem_map;              // Array of all physical pages
 static uint32_t total_pages = 0;
-FreeList free_areas[MAX_ORDER];
+// RAM and ACPI ranges from e820; only these get write-back direct mappings
+#define DIRECT_MAP_MAX 32
+static struct { uint64_t start, end; } direct_map[DIRECT_MAP_MAX];
+static int direct_map_count = 0;
+Zone zones[MAX_NR_ZONES];
 
 // --- Helper Functions ---
 
@@ -922,20 +1128,39 @@ void list_remove(Page** head, Page* node) {
     node->next = node->prev = NULL;
 }
 
-Page* alloc_pages(int order) {
+static inline Zone* page_zone(Page* page) {
+    uint32_t pfn = page - mem_map;
+    if (pfn < zones[ZONE_DMA].end_pfn) return &zones[ZONE_DMA];
+    if (pfn < zones[ZONE_DMA32].end_pfn) return &zones[ZONE_DMA32];
+    return &zones[ZONE_NORMAL];
+}
+
+static void free_area_add(Zone* zone, Page* page, int order) {
+    page->flags = PAGE_FLAG_BUDDY;
+    page->order = order;
+    list_add(&zone->free_areas[order].head, page);
+    zone->free_areas[order].nr_free++;
+}
+
+static void free_area_remove(Zone* zone, Page* page, int order) {
+    list_remove(&zone->free_areas[order].head, page);
+    zone->free_areas[order].nr_free--;
+    page->flags = 0;
+}
+
+Page* buddy_alloc(Zone* zone, int order) {
+    FreeList* free_areas = zone->free_areas;
     for (int current_order = order; current_order < MAX_ORDER; current_order++) {
         if (free_areas[current_order].head) {
             Page* page = free_areas[current_order].head;
-            list_remove(&free_areas[current_order].head, page);
-            page->flags = 1; // Mark used
+            free_area_remove(zone, page, current_order);
+            page->flags = PAGE_FLAG_USED;
+            zone->free_pages -= 1u << order;
 
             // Split down to requested order
             while (current_order > order) {
                 current_order--;
-                Page* buddy = page + (1 << current_order);
-                buddy->flags = 0;
-                buddy->order = current_order;
-                list_add(&free_areas[current_order].head, buddy);
+                free_area_add(zone, page + (1 << current_order), current_order);
             }
             page->order = order;
             return page;
@@ -944,7 +1169,50 @@ Page* alloc_pages(int order) {
     return NULL; // OOM
 }
 
-void free_pages(Page* page, int order) {
+uint32_t kmem_cache_reap(void);
+uint32_t zero_pool_drain(void);
+uint32_t compact_zone(Zone* zone, int order);
+static void compact_request(int order);
+static spinlock_t pmm_lock;   // Tasks allocate concurrently with the idle task
+
+// Tries the highest allowed zone first, then falls back to lower ones.
+// The preferred zone may be drained to its min watermark; a fallback zone
+// only down to its low watermark, so scarce DMA memory isn't used up by
+// allocations that could have lived anywhere. With check_watermarks off
+// any free block is taken.
+static Page* zone_alloc(int order, zone_type_t highest, bool check_watermarks) {
+    unsigned long irq = spinlock_acquire_irqsave(&pmm_lock);
+    Page* page = NULL;
+    for (int z = highest; z >= 0 && !page; z--) {
+        Zone* zone = &zones[z];
+        uint32_t reserve = (z == (int)highest) ? zone->watermark_min
+                                               : zone->watermark_low + zone->lowmem_reserve;
+        if (check_watermarks && zone->free_pages < reserve + (1u << order)) continue;
+        page = buddy_alloc(zone, order);
+    }
+    spinlock_release_irqrestore(&pmm_lock, irq);
+    return page;
+}
+
+Page* alloc_pages_zone(int order, zone_type_t highest) {
+    Page* page = zone_alloc(order, highest, true);
+    // Low on memory: give back empty slabs and pre-zeroed pages, retry once
+    if (!page && kmem_cache_reap() + zero_pool_drain() > 0) page = zone_alloc(order, highest, true);
+    // Memory may be free but too fragmented for a multi-page block. Callers
+    // can hold locks with interrupts off, so compaction, which stops the
+    // other CPUs, is left to kmemd.
+    if (!page && order > 0) compact_request(order);
+    if (!page) page = zone_alloc(order, highest, false);
+    return page;
+}
+
+Page* alloc_pages(int order) {
+    return alloc_pages_zone(order, ZONE_NORMAL);
+}
+
+static void buddy_free(Page* page, int order) {
+    Zone* zone = page_zone(page);
+    zone->free_pages += 1u << order;
     uint32_t pfn = page - mem_map;
     page->flags = 0;
 
@@ -953,12 +1221,12 @@ void free_pages(Page* page, int order) {
         uint32_t buddy_pfn = pfn ^ (1 << order);
         Page* buddy = &mem_map[buddy_pfn];
 
-        if (buddy_pfn >= total_pages || buddy->flags == 1 || buddy->order != order) {
+        if (buddy_pfn >= zone->end_pfn || !(buddy->flags & PAGE_FLAG_BUDDY) || buddy->order != order) {
             break; // Cannot merge
         }
 
         // Remove buddy from free list
-        list_remove(&free_areas[order].head, buddy);
+        free_area_remove(zone, buddy, order);
         
         // Combine
         if (buddy_pfn < pfn) {
@@ -968,12 +1236,18 @@ void free_pages(Page* page, int order) {
         order++;
     }
 
-    page->order = order;
-    list_add(&free_areas[order].head, page);
+    free_area_add(zone, page, order);
+}
+
+void free_pages(Page* page, int order) {
+    unsigned long irq = spinlock_acquire_irqsave(&pmm_lock);
+    buddy_free(page, order);
+    spinlock_release_irqrestore(&pmm_lock, irq);
 }
 
 void mm_init(struct boot_params* params) {
     memblock_init();
+    spinlock_init(&pmm_lock);
 
     // 1. Calculate max RAM
     uint64_t max_ram = 0;
@@ -982,9 +1256,28 @@ void mm_init(struct boot_params* params) {
         if (e->type == 1 && (e->addr + e->size) > max_ram) {
             max_ram = e->addr + e->size;
         }
+        // RAM plus ACPI reclaimable/NVS, so firmware tables stay reachable
+        if (e->type != 1 && e->type != 3 && e->type != 4) continue;
+        if (direct_map_count < DIRECT_MAP_MAX && e->size) {
+            direct_map[direct_map_count].start = e->addr & ~(uint64_t)(PAGE_SIZE - 1);
+            direct_map[direct_map_count].end = align_up(e->addr + e->size, PAGE_SIZE);
+            direct_map_count++;
+        }
     }
     total_pages = max_ram / PAGE_SIZE;
 
+    // Zones: ISA DMA below 16 MB, 32-bit DMA below 4 GB, the rest NORMAL
+    static const char* zone_names[MAX_NR_ZONES] = { "DMA", "DMA32", "Normal" };
+    static const uint64_t zone_limits[MAX_NR_ZONES] = { 0x1000000ULL, 0x100000000ULL, ~0ULL };
+    uint32_t zone_start = 0;
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        uint64_t limit = zone_limits[z] / PAGE_SIZE;
+        zones[z].name = zone_names[z];
+        zones[z].start_pfn = zone_start;
+        zones[z].end_pfn = limit < total_pages ? (uint32_t)limit : total_pages;
+        zone_start = zones[z].end_pfn;
+    }
+
     // 2. Allocate Mem Map (using Memblock)
     size_t map_size = total_pages * sizeof(Page);
     mem_map = memblock_alloc(map_size);
@@ -1019,95 +1312,530 @@ void mm_init(struct boot_params* params) {
                 // We force flags=1 before freeing so free_pages logic works
                 p->flags = 1; 
                 free_pages(p, 0);
+                page_zone(p)->managed_pages++;
             }
         }
     }
+
+    // Reserve about 1/64 of each zone; fallbacks leave a quarter more
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        Zone* zone = &zones[z];
+        zone->watermark_min = zone->managed_pages / 64;
+        zone->watermark_low = zone->watermark_min + zone->watermark_min / 4;
+    }
+    // Below 4 GB DMA32 is ordinary memory, but ISA DMA space stays scarce
+    zones[ZONE_DMA].lowmem_reserve = zones[ZONE_DMA].managed_pages / 4;
 }
 
 // --- 3. SLAB Allocator ---
 
-Cache kmem_cache_create(size_t obj_size) {
-    Cache c;
-    c.obj_size = align_up(obj_size, 4);
-    c.slab_order = 0;
-    
-    // Calculate objects per slab (using 1 page for simplicity)
-    // Layout: [Slab Header] [Free Index Array] [Objects...]
-    size_t overhead = sizeof(Slab);
-    size_t space = PAGE_SIZE - overhead;
-    c.obj_per_slab = space / (c.obj_size + 2); // +2 for uint16_t index
-    
-    c.slabs_full = c.slabs_partial = c.slabs_free = NULL;
-    return c;
+static Cache* cache_chain = NULL;   // Every initialized cache, for reaping
+static Cache slab_header_cache;     // Backs off-slab headers
+static Cache magazine_cache;        // Backs the magazine layer
+
+void* kmem_cache_alloc(Cache* cache);
+void kmem_cache_free(Cache* cache, void* obj);
+void kmalloc_init(void);
+
+static inline uint16_t* slab_indices(Slab* slab) {
+    return (uint16_t*)((uintptr_t)slab + sizeof(Slab));
 }
 
-void* kmem_cache_alloc(Cache* cache) {
+static void slab_list_add(Slab** head, Slab* slab) {
+    slab->next = *head;
+    slab->prev = NULL;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(Slab** head, Slab* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+// Objects that fit in a slab of the given order, honouring header placement.
+static uint32_t slab_estimate(uint32_t obj_size, uint32_t order, bool off_slab, uint32_t* header_size) {
+    size_t bytes = (size_t)PAGE_SIZE << order;
+    uint32_t n;
+    if (off_slab) {
+        n = bytes / obj_size;
+        if (n > SLAB_OFFSLAB_MAX) n = SLAB_OFFSLAB_MAX;
+        *header_size = 0;
+        return n;
+    }
+    // Layout: [Slab Header] [Free Index Array] [Color] [Objects...]
+    n = (bytes - sizeof(Slab)) / (obj_size + sizeof(uint16_t));
+    while (n > 0 && align_up(sizeof(Slab) + n * sizeof(uint16_t), SLAB_OBJ_ALIGN) + (size_t)n * obj_size > bytes) n--;
+    if (n > 0xFFFE) n = 0xFFFE; // 0xFFFF is the end marker
+    *header_size = align_up(sizeof(Slab) + n * sizeof(uint16_t), SLAB_OBJ_ALIGN);
+    return n;
+}
+
+void kmem_cache_init(Cache* cache, const char* name, size_t obj_size,
+                     void (*ctor)(void*), void (*dtor)(void*)) {
+    memset(cache, 0, sizeof(Cache));
+    cache->name = name;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->mag_size = MAG_DEFAULT_ROUNDS;
+    spinlock_init(&cache->lock);
+    spinlock_init(&cache->depot_lock);
+    cache->obj_size = align_up(obj_size ? obj_size : 1, SLAB_OBJ_ALIGN);
+    if (cache->obj_size >= SLAB_OFFSLAB_LIMIT) cache->flags |= SLAB_FLAG_OFFSLAB;
+    bool off_slab = cache->flags & SLAB_FLAG_OFFSLAB;
+
+    // Pick the smallest order that wastes no more than 1/8 of the slab
+    for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++) {
+        uint32_t header;
+        uint32_t n = slab_estimate(cache->obj_size, order, off_slab, &header);
+        if (n == 0) continue;
+        size_t bytes = (size_t)PAGE_SIZE << order;
+        size_t waste = bytes - header - (size_t)n * cache->obj_size;
+        cache->slab_order = order;
+        cache->obj_per_slab = n;
+        cache->header_size = header;
+        if (waste * 8 <= bytes) break;
+    }
+
+    size_t leftover = ((size_t)PAGE_SIZE << cache->slab_order) - cache->header_size
+                    - (size_t)cache->obj_per_slab * cache->obj_size;
+    cache->color_range = leftover / SLAB_COLOR_ALIGN;
+
+    cache->next = cache_chain;
+    cache_chain = cache;
+}
+
+static Slab* slab_grow(Cache* cache) {
+    if (cache->obj_per_slab == 0) return NULL;
+    Page* p = alloc_pages(cache->slab_order);
+    if (!p) return NULL;
+
+    uintptr_t base = page_to_phys(p);
+    Slab* slab;
+    if (cache->flags & SLAB_FLAG_OFFSLAB) {
+        slab = (Slab*)kmem_cache_alloc(&slab_header_cache);
+        if (!slab) {
+            free_pages(p, cache->slab_order);
+            return NULL;
+        }
+    } else {
+        slab = (Slab*)base;
+    }
+
+    slab->base = base;
+    slab->cache = cache;
+    slab->objects = (void*)(base + cache->header_size + cache->color_next * SLAB_COLOR_ALIGN);
+    slab->inuse = 0;
+    slab->free_idx = 0;
+    slab->next = slab->prev = NULL;
+    if (++cache->color_next > cache->color_range) cache->color_next = 0;
+
+    // Init free indices
+    uint16_t* indices = slab_indices(slab);
+    for (uint32_t i = 0; i < cache->obj_per_slab - 1; i++) indices[i] = i + 1;
+    indices[cache->obj_per_slab - 1] = 0xFFFF; // End marker
+
+    // Every page of the slab points back at its header so frees can find it
+    for (uint32_t i = 0; i < (1u << cache->slab_order); i++) p[i].slab = slab;
+
+    cache->total_slabs++;
+    return slab;
+}
+
+static void slab_free_locked(Cache* cache, void* obj);
+
+// Returns a slab's pages to the buddy allocator. An off-slab header goes
+// back to slab_header_cache, whose lock the caller may already hold.
+static void slab_destroy_header(Cache* cache, Slab* slab, bool header_locked) {
+    Page* p = phys_to_page(slab->base);
+    for (uint32_t i = 0; i < (1u << cache->slab_order); i++) p[i].slab = NULL;
+    if (cache->flags & SLAB_FLAG_OFFSLAB) {
+        if (header_locked) slab_free_locked(&slab_header_cache, slab);
+        else kmem_cache_free(&slab_header_cache, slab);
+    }
+    free_pages(p, cache->slab_order);
+    cache->total_slabs--;
+}
+
+static void slab_destroy(Cache* cache, Slab* slab) {
+    slab_destroy_header(cache, slab, false);
+}
+
+static void* slab_alloc_locked(Cache* cache) {
     Slab* slab = cache->slabs_partial;
     
     if (!slab) {
         // No partial slabs, check free slabs or allocate new
         if (cache->slabs_free) {
             slab = cache->slabs_free;
-            list_remove((Page**)&cache->slabs_free, (Page*)slab); // Cast hack for list util
+            slab_list_remove(&cache->slabs_free, slab);
+            cache->free_slabs--;
         } else {
-            // Allocate new page from Buddy
-            Page* p = alloc_pages(0); // Order 0
-            if (!p) return NULL;
-            
-            slab = (Slab*)page_to_phys(p);
-            slab->objects = (void*)((uintptr_t)slab + sizeof(Slab) + cache->obj_per_slab * 2);
-            slab->inuse = 0;
-            slab->free_idx = 0;
-            slab->next = NULL;
-            
-            // Init free indices
-            uint16_t* indices = (uint16_t*)((uintptr_t)slab + sizeof(Slab));
-            for (uint32_t i = 0; i < cache->obj_per_slab - 1; i++) indices[i] = i + 1;
-            indices[cache->obj_per_slab - 1] = 0xFFFF; // End marker
+            slab = slab_grow(cache);
+            if (!slab) return NULL;
         }
-        // Add to partial list
-        slab->next = cache->slabs_partial;
-        cache->slabs_partial = slab;
+        slab_list_add(&cache->slabs_partial, slab);
     }
 
     // Allocate object
-    uint16_t* indices = (uint16_t*)((uintptr_t)slab + sizeof(Slab));
+    uint16_t* indices = slab_indices(slab);
     uint32_t idx = slab->free_idx;
     slab->free_idx = indices[idx];
     slab->inuse++;
 
     if (slab->free_idx == 0xFFFF) {
         // Move to full list
-        cache->slabs_partial = slab->next;
-        slab->next = cache->slabs_full;
-        cache->slabs_full = slab;
+        slab_list_remove(&cache->slabs_partial, slab);
+        slab_list_add(&cache->slabs_full, slab);
     }
 
+    cache->active_objs++;
+    cache->slab_allocs++;
     return (void*)((uintptr_t)slab->objects + idx * cache->obj_size);
 }
 
-void kmem_cache_free(Cache* cache, void* obj) {
-    if (!obj) return;
+static void slab_free_locked(Cache* cache, void* obj) {
+    // 1. Find the Slab Header through the page descriptor (works for
+    // multi-page and off-slab slabs alike)
+    Page* page = phys_to_page((uintptr_t)obj);
+    if (!page || !page->slab || page->slab->cache != cache) return;
+    Slab* slab = page->slab;
 
-    // 1. Find the Slab Header
-    // Since slabs are 4KB aligned (PAGE_SIZE) and the header is at the start,
-    // we can mask the address to find the page start.
-    uintptr_t page_addr = (uintptr_t)obj & ~(PAGE_SIZE - 1);
-    Slab* slab = (Slab*)page_addr;
-
-    // 2. Calculate the object index
-    // We need to know where the objects start relative to the page
-    uintptr_t objects_start = (uintptr_t)slab->objects;
-    uintptr_t obj_addr = (uintptr_t)obj;
-    
-    // Calculate index: (Address - Start) / Size
-    uint32_t idx = (obj_addr - objects_start) / cache->obj_size;
+    // 2. Calculate the object index: (Address - Start) / Size
+    uint32_t idx = ((uintptr_t)obj - (uintptr_t)slab->objects) / cache->obj_size;
+    if (idx >= cache->obj_per_slab) return;
 
     // 3. Push index back onto the Free Index Array (LIFO)
-    uint16_t* indices = (uint16_t*)((uintptr_t)slab + sizeof(Slab));
+    bool was_full = (slab->free_idx == 0xFFFF);
+    uint16_t* indices = slab_indices(slab);
     indices[idx] = slab->free_idx; // Point this slot to the previous head
     slab->free_idx = idx;          // Make this slot the new head
     slab->inuse--;
+    cache->active_objs--;
+
+    // 4. Move the slab to the list matching its new fill level
+    if (was_full) slab_list_remove(&cache->slabs_full, slab);
+    else if (slab->inuse == 0) slab_list_remove(&cache->slabs_partial, slab);
+
+    if (slab->inuse == 0) {
+        if (cache->free_slabs >= SLAB_FREE_KEEP) {
+            slab_destroy(cache, slab);
+        } else {
+            slab_list_add(&cache->slabs_free, slab);
+            cache->free_slabs++;
+        }
+    } else if (was_full) {
+        slab_list_add(&cache->slabs_partial, slab);
+    }
+}
+
+static void* slab_alloc_obj(Cache* cache) {
+    unsigned long flags = spinlock_acquire_irqsave(&cache->lock);
+    void* obj = slab_alloc_locked(cache);
+    spinlock_release_irqrestore(&cache->lock, flags);
+    if (obj && cache->ctor) cache->ctor(obj);
+    return obj;
+}
+
+static void slab_free_obj(Cache* cache, void* obj) {
+    if (cache->dtor) cache->dtor(obj);
+    unsigned long flags = spinlock_acquire_irqsave(&cache->lock);
+    slab_free_locked(cache, obj);
+    spinlock_release_irqrestore(&cache->lock, flags);
+}
+
+// --- 4. Magazine Layer ---
+// Objects parked in magazines stay constructed; ctor/dtor only run when an
+// object moves between the slab layer and the magazine layer.
+
+static inline void mag_swap(CpuCache* cc) {
+    Magazine* tmp = cc->loaded;
+    cc->loaded = cc->previous;
+    cc->previous = tmp;
+}
+
+void* kmem_cache_alloc(Cache* cache) {
+    if (cache->flags & SLAB_FLAG_NOMAG) return slab_alloc_obj(cache);
+
+    unsigned long flags = local_irq_save();
+    CpuCache* cc = &cache->cpu[smp_processor_id()];
+    cc->allocs++;
+    for (;;) {
+        if (cc->loaded && cc->loaded->rounds > 0) {
+            void* obj = cc->loaded->objs[--cc->loaded->rounds];
+            cc->alloc_hits++;
+            local_irq_restore(flags);
+            return obj;
+        }
+        if (cc->previous && cc->previous->rounds > 0) {
+            mag_swap(cc);
+            continue;
+        }
+        // Both magazines empty: trade the previous one for a full one from the depot
+        spinlock_acquire(&cache->depot_lock);
+        Magazine* full = cache->depot_full;
+        if (!full) {
+            spinlock_release(&cache->depot_lock);
+            break;
+        }
+        cache->depot_full = full->next;
+        cache->depot_full_count--;
+        if (cc->previous) {
+            cc->previous->next = cache->depot_empty;
+            cache->depot_empty = cc->previous;
+            cache->depot_empty_count++;
+        }
+        cache->depot_hits++;
+        spinlock_release(&cache->depot_lock);
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+    }
+    local_irq_restore(flags);
+    return slab_alloc_obj(cache);
+}
+
+void kmem_cache_free(Cache* cache, void* obj) {
+    if (!obj) return;
+    if (cache->flags & SLAB_FLAG_NOMAG) {
+        slab_free_obj(cache, obj);
+        return;
+    }
+
+    unsigned long flags = local_irq_save();
+    CpuCache* cc = &cache->cpu[smp_processor_id()];
+    cc->frees++;
+    for (;;) {
+        if (cc->loaded && cc->loaded->rounds < cache->mag_size) {
+            cc->loaded->objs[cc->loaded->rounds++] = obj;
+            cc->free_hits++;
+            local_irq_restore(flags);
+            return;
+        }
+        if (cc->previous && cc->previous->rounds == 0) {
+            mag_swap(cc);
+            continue;
+        }
+        // Both magazines full: trade the previous one for an empty one
+        spinlock_acquire(&cache->depot_lock);
+        Magazine* empty = cache->depot_empty;
+        if (empty) {
+            cache->depot_empty = empty->next;
+            cache->depot_empty_count--;
+        }
+        spinlock_release(&cache->depot_lock);
+        if (!empty) {
+            empty = (Magazine*)kmem_cache_alloc(&magazine_cache);
+            if (!empty) break;
+        }
+        empty->rounds = 0;
+        if (cc->previous) {
+            spinlock_acquire(&cache->depot_lock);
+            cc->previous->next = cache->depot_full;
+            cache->depot_full = cc->previous;
+            cache->depot_full_count++;
+            spinlock_release(&cache->depot_lock);
+        }
+        cc->previous = cc->loaded;
+        cc->loaded = empty;
+    }
+    local_irq_restore(flags);
+    slab_free_obj(cache, obj);
+}
+
+// Allocates up to count objects; returns how many were allocated.
+size_t kmem_cache_alloc_bulk(Cache* cache, size_t count, void** objs) {
+    size_t n = 0;
+    uint32_t cpu = smp_processor_id();
+    if (!(cache->flags & SLAB_FLAG_NOMAG)) {
+        unsigned long flags = local_irq_save();
+        CpuCache* cc = &cache->cpu[cpu];
+        while (n < count) {
+            if (!cc->loaded || cc->loaded->rounds == 0) {
+                if (cc->previous && cc->previous->rounds > 0) {
+                    mag_swap(cc);
+                    continue;
+                }
+                break;
+            }
+            objs[n++] = cc->loaded->objs[--cc->loaded->rounds];
+        }
+        cc->allocs += n;
+        cc->alloc_hits += n;
+        local_irq_restore(flags);
+    }
+
+    // Fill the rest straight from the slab layer under a single lock hold
+    size_t first = n;
+    if (n < count) {
+        unsigned long flags = spinlock_acquire_irqsave(&cache->lock);
+        while (n < count && (objs[n] = slab_alloc_locked(cache)) != NULL) n++;
+        if (!(cache->flags & SLAB_FLAG_NOMAG)) cache->cpu[cpu].allocs += n - first;
+        spinlock_release_irqrestore(&cache->lock, flags);
+        if (cache->ctor) {
+            for (size_t i = first; i < n; i++) cache->ctor(objs[i]);
+        }
+    }
+    return n;
+}
+
+void kmem_cache_free_bulk(Cache* cache, size_t count, void** objs) {
+    size_t n = 0;
+    if (!(cache->flags & SLAB_FLAG_NOMAG)) {
+        unsigned long flags = local_irq_save();
+        CpuCache* cc = &cache->cpu[smp_processor_id()];
+        while (n < count) {
+            if (!cc->loaded || cc->loaded->rounds >= cache->mag_size) {
+                if (cc->previous && cc->previous->rounds == 0) {
+                    mag_swap(cc);
+                    continue;
+                }
+                break;
+            }
+            if (objs[n]) cc->loaded->objs[cc->loaded->rounds++] = objs[n];
+            n++;
+        }
+        cc->frees += n;
+        cc->free_hits += n;
+        local_irq_restore(flags);
+    }
+
+    if (n == count) return;
+    if (cache->dtor) {
+        for (size_t i = n; i < count; i++) if (objs[i]) cache->dtor(objs[i]);
+    }
+    unsigned long flags = spinlock_acquire_irqsave(&cache->lock);
+    for (; n < count; n++) if (objs[n]) slab_free_locked(cache, objs[n]);
+    spinlock_release_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_set_magazine_size(Cache* cache, uint32_t rounds) {
+    if (rounds == 0) rounds = 1;
+    if (rounds > MAG_MAX_ROUNDS) rounds = MAG_MAX_ROUNDS;
+    cache->mag_size = rounds;
+}
+
+// Pushes every object parked in the depot's full magazines back to the slab
+// layer. Caller holds cache->lock; emptied magazines stay on the depot.
+static void depot_drain_locked(Cache* cache) {
+    if (!spinlock_trylock(&cache->depot_lock)) return;
+    Magazine* full = cache->depot_full;
+    cache->depot_full = NULL;
+    cache->depot_full_count = 0;
+    while (full) {
+        Magazine* next = full->next;
+        while (full->rounds > 0) {
+            void* obj = full->objs[--full->rounds];
+            if (cache->dtor) cache->dtor(obj);
+            slab_free_locked(cache, obj);
+        }
+        full->next = cache->depot_empty;
+        cache->depot_empty = full;
+        cache->depot_empty_count++;
+        full = next;
+    }
+    spinlock_release(&cache->depot_lock);
+}
+
+static uint32_t slabs_free_locked(Cache* cache, bool header_locked) {
+    uint32_t freed = 0;
+    while (cache->slabs_free) {
+        Slab* slab = cache->slabs_free;
+        slab_list_remove(&cache->slabs_free, slab);
+        cache->free_slabs--;
+        slab_destroy_header(cache, slab, header_locked);
+        freed += 1u << cache->slab_order;
+    }
+    return freed;
+}
+
+static uint32_t cache_shrink_locked(Cache* cache) {
+    depot_drain_locked(cache);
+    return slabs_free_locked(cache, false);
+}
+
+// Returns every empty slab of a cache (and its spare magazines) to the buddy allocator.
+uint32_t kmem_cache_shrink(Cache* cache) {
+    unsigned long flags = spinlock_acquire_irqsave(&cache->lock);
+    uint32_t freed = cache_shrink_locked(cache);
+    spinlock_release_irqrestore(&cache->lock, flags);
+
+    flags = spinlock_acquire_irqsave(&cache->depot_lock);
+    Magazine* empty = cache->depot_empty;
+    cache->depot_empty = NULL;
+    cache->depot_empty_count = 0;
+    spinlock_release_irqrestore(&cache->depot_lock, flags);
+    while (empty) {
+        Magazine* next = empty->next;
+        kmem_cache_free(&magazine_cache, empty);
+        empty = next;
+    }
+    return freed;
+}
+
+// Shrinks every cache; called when the buddy allocator runs dry. Runs from
+// inside allocation paths (even slab_header_cache's own slab_grow), so it
+// only ever trylocks: caches whose locks are held are skipped, and so are
+// off-slab caches while slab_header_cache is busy. Depots are drained only
+// for on-slab caches without a dtor; anything that would free a header or
+// call out of the allocator waits for an explicit kmem_cache_shrink.
+uint32_t kmem_cache_reap(void) {
+    uint32_t freed = 0;
+    for (Cache* c = cache_chain; c; c = c->next) {
+        unsigned long flags = local_irq_save();
+        if (spinlock_trylock(&c->lock)) {
+            if (!(c->flags & SLAB_FLAG_OFFSLAB)) {
+                if (!c->dtor) depot_drain_locked(c);
+                freed += slabs_free_locked(c, false);
+            } else if (spinlock_trylock(&slab_header_cache.lock)) {
+                freed += slabs_free_locked(c, true);
+                spinlock_release(&slab_header_cache.lock);
+            }
+            spinlock_release(&c->lock);
+        }
+        local_irq_restore(flags);
+    }
+    return freed;
+}
+
+void slabinfo_print(void) {
+    vga_print_string("\nname            objsize  slabs  active  mag  hit%  depot\n");
+    for (Cache* c = cache_chain; c; c = c->next) {
+        uint64_t allocs = 0, hits = 0;
+        for (int i = 0; i < MAX_CPUS; i++) {
+            allocs += c->cpu[i].allocs + c->cpu[i].frees;
+            hits += c->cpu[i].alloc_hits + c->cpu[i].free_hits;
+        }
+        vga_print_string(c->name);
+        for (size_t pad = strlen(c->name); pad < 16; pad++) vga_putchar(' ');
+        vga_print_dec(c->obj_size);
+        vga_print_string("  ");
+        vga_print_dec(c->total_slabs);
+        vga_print_string("  ");
+        vga_print_dec(c->active_objs);
+        vga_print_string("  ");
+        if (c->flags & SLAB_FLAG_NOMAG) {
+            vga_print_string("-\n");
+            continue;
+        }
+        vga_print_dec(c->mag_size);
+        vga_print_string("  ");
+        vga_print_dec(allocs ? (uint32_t)(hits * 100 / allocs) : 0);
+        vga_print_string("%  ");
+        vga_print_dec(c->depot_full_count);
+        vga_print_string("/");
+        vga_print_dec(c->depot_empty_count);
+        vga_print_string("\n");
+    }
+}
+
+void slab_init(void) {
+    kmem_cache_init(&slab_header_cache, "slab-header", sizeof(Slab) + SLAB_OFFSLAB_MAX * sizeof(uint16_t), NULL, NULL);
+    slab_header_cache.flags |= SLAB_FLAG_NOMAG;
+    kmem_cache_init(&magazine_cache, "magazine", sizeof(Magazine), NULL, NULL);
+    magazine_cache.flags |= SLAB_FLAG_NOMAG;
+    kmalloc_init();
 }
 
 // --- PMM Adapter Functions (For compatibility with existing kernel code) ---
@@ -1119,11 +1847,16 @@ void* pmm_alloc_page(void) {
 }
 
 void* pmm_alloc_pages(uint32_t count) {
+    return pmm_alloc_pages_zone(count, ZONE_NORMAL);
+}
+
+// For device buffers: the block lies entirely inside `highest` or below.
+void* pmm_alloc_pages_zone(uint32_t count, zone_type_t highest) {
     // Calculate order needed
     int order = 0;
     while ((1u << order) < count) order++;
     
-    Page* p = alloc_pages(order);
+    Page* p = alloc_pages_zone(order, highest);
     if (!p) return NULL;
     return (void*)page_to_phys(p);
 }
@@ -1134,239 +1867,2466 @@ void pmm_free_page(void* p) {
     if (page) free_pages(page, 0);
 }
 
-uint32_t pmm_get_free_memory(void) {
-    // Calculate free memory from free lists
-    uint32_t total_free = 0;
-    for (int order = 0; order < MAX_ORDER; ++order) {
-        uint32_t block_pages = (1u << order);
-        Page* cur = free_areas[order].head;
-        while (cur) {
-            total_free += block_pages * PAGE_SIZE;
-            cur = cur->next;
+// --- Pre-zeroed page pool ---
+// The idle task and kmemd clear pages ahead of time with non-temporal
+// stores so page-table, stack and task allocations don't pay for zeroing.
+// Pooled pages are allocated from the buddy and chained through Page->next.
+#define ZERO_POOL_TARGET 64
+
+static Page* zero_pool = NULL;
+static uint32_t zero_pool_count = 0;
+static spinlock_t zero_pool_lock;
+
+void* alloc_zeroed_page(void) {
+    unsigned long irq = spinlock_acquire_irqsave(&zero_pool_lock);
+    Page* p = zero_pool;
+    if (p) {
+        zero_pool = p->next;
+        p->next = NULL;
+        zero_pool_count--;
+    }
+    spinlock_release_irqrestore(&zero_pool_lock, irq);
+    if (p) return (void*)page_to_phys(p);
+
+    // Pool empty: zero synchronously
+    void* page = pmm_alloc_page();
+    if (page) memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+// Zeroes one page into the pool. Returns false once the pool is full or
+// memory is short, so the caller can go back to sleep.
+bool zero_pool_refill(void) {
+    if (zero_pool_count >= ZERO_POOL_TARGET) return false;
+    void* page = pmm_alloc_page();
+    if (!page) return false;
+    clear_page_nt(page);
+    Page* p = phys_to_page((uintptr_t)page);
+    unsigned long irq = spinlock_acquire_irqsave(&zero_pool_lock);
+    p->next = zero_pool;
+    zero_pool = p;
+    zero_pool_count++;
+    spinlock_release_irqrestore(&zero_pool_lock, irq);
+    return true;
+}
+
+// Returns every pooled page to the buddy allocator.
+uint32_t zero_pool_drain(void) {
+    unsigned long irq = spinlock_acquire_irqsave(&zero_pool_lock);
+    Page* list = zero_pool;
+    uint32_t count = zero_pool_count;
+    zero_pool = NULL;
+    zero_pool_count = 0;
+    spinlock_release_irqrestore(&zero_pool_lock, irq);
+    while (list) {
+        Page* next = list->next;
+        list->next = NULL;
+        free_pages(list, 0);
+        list = next;
+    }
+    return count;
+}
+
+// --- Compaction ---
+// Free memory can be plentiful yet split into blocks too small for an
+// order-N request. Compaction picks aligned target blocks that hold only
+// free and movable pages, moves the movable pages elsewhere (copy and
+// remap), and lets the buddy merge the emptied block. Movable pages are
+// VMA and vmalloc frames, which the kernel only reaches through their
+// mapping. Empty slabs and pooled zero pages are simply given back first.
+#define COMPACT_TRIGGER_ORDER    3     // Larger requests are costly to satisfy
+#define FRAG_INDEX_THRESHOLD     500   // Out of 1000; above this, failures are fragmentation
+#define COMPACT_INTERVAL_TICKS   100
+
+bool paging_migrate_page(uintptr_t virt, uint64_t old_phys, uint64_t new_phys);
+void pmm_mark_movable(void* frame, uintptr_t virt) {
+    Page* page = phys_to_page((uintptr_t)frame);
+    if (!page) return;
+    page->flags |= PAGE_FLAG_MOVABLE;
+    page->mapping = virt;
+}
+
+// Fragmentation index for an order (Gorman): near 1000 means a failure
+// would be due to fragmentation, near 0 to lack of memory, -1000 means a
+// suitable block is free right now.
+int fragmentation_index(Zone* zone, int order) {
+    uint32_t blocks = 0;
+    for (int o = 0; o < MAX_ORDER; o++) {
+        if (o >= order && zone->free_areas[o].nr_free) return -1000;
+        blocks += zone->free_areas[o].nr_free;
+    }
+    if (blocks == 0) return 0;
+    uint64_t requested = 1u << order;
+    return 1000 - (int)((1000 + (uint64_t)zone->free_pages * 1000 / requested) / blocks);
+}
+
+// Classifies the block [pfn, pfn + 2^order). Returns the number of movable
+// pages, or -1 if the block contains anything that cannot be moved.
+static int compact_scan_block(uint32_t pfn, int order) {
+    uint32_t end = pfn + (1u << order);
+    int movable = 0;
+    if (!(mem_map[pfn].flags & (PAGE_FLAG_BUDDY | PAGE_FLAG_USED))) return -1; // Inside a larger block
+    while (pfn < end) {
+        Page* p = &mem_map[pfn];
+        if (p->flags & PAGE_FLAG_BUDDY) {
+            if (p->order >= order) return 0;   // Already free
+        } else if ((p->flags & PAGE_FLAG_MOVABLE) && p->order == 0) {
+            movable++;
+        } else {
+            return -1;
+        }
+        pfn += 1u << p->order;
+    }
+    return movable;
+}
+
+static bool zone_has_block(Zone* zone, int order) {
+    for (int o = order; o < MAX_ORDER; o++) if (zone->free_areas[o].nr_free) return true;
+    return false;
+}
+
+// Empties target blocks until the zone has a free block of `order`. With
+// order < 0 every evacuable top-order block is emptied. Returns pages moved.
+uint32_t compact_zone(Zone* zone, int order) {
+    bool full = order < 0;
+    if (full) order = MAX_ORDER - 1;
+    if (zone->end_pfn <= zone->start_pfn) return 0;
+
+    uint32_t moved = 0;
+    uint32_t block = 1u << order;
+    // Interrupts stay off and the other CPUs are parked for the whole pass
+    // so nothing writes a page between its copy and its remap. The caller
+    // must hold no spinlock: a CPU spinning on it would never park.
+    unsigned long irq = local_irq_save();
+    smp_stop_others();
+    for (uint32_t pfn = align_up(zone->start_pfn, block); pfn + block <= zone->end_pfn; pfn += block) {
+        if (!full && zone_has_block(zone, order)) break;
+
+        int movable = compact_scan_block(pfn, order);
+        if (movable <= 0 || zone->free_pages < block + (uint32_t)movable) continue;
+
+        Page* held = NULL;   // Destination pages that landed inside the target
+        for (uint32_t i = pfn; i < pfn + block; ) {
+            Page* src = &mem_map[i];
+            uint32_t step = 1u << src->order;
+            if (!(src->flags & PAGE_FLAG_MOVABLE)) {
+                i += step;
+                continue;
+            }
+            unsigned long lock = spinlock_acquire_irqsave(&pmm_lock);
+            Page* dst = buddy_alloc(zone, 0);
+            while (dst && (uint32_t)(dst - mem_map) >= pfn && (uint32_t)(dst - mem_map) < pfn + block) {
+                dst->next = held;
+                held = dst;
+                dst = buddy_alloc(zone, 0);
+            }
+            spinlock_release_irqrestore(&pmm_lock, lock);
+            if (!dst) break;
+
+            uintptr_t virt = src->mapping;
+            if (!paging_migrate_page(virt, page_to_phys(src), page_to_phys(dst))) {
+                free_pages(dst, 0);
+                break;
+            }
+            pmm_mark_movable((void*)page_to_phys(dst), virt);
+            free_pages(src, 0);
+            moved++;
+            i += step;
+        }
+        while (held) {
+            Page* next = held->next;
+            free_pages(held, 0);
+            held = next;
+        }
+    }
+    smp_resume_others();   // Parked CPUs flush their TLBs on the way out
+    local_irq_restore(irq);
+    return moved;
+}
+
+uint32_t compact_memory(int order) {
+    kmem_cache_reap();
+    zero_pool_drain();
+    uint32_t moved = 0;
+    for (int z = 0; z < MAX_NR_ZONES; z++) moved += compact_zone(&zones[z], order);
+    return moved;
+}
+
+static volatile int compact_pending_order = -1;   // Largest order that failed since the last pass
+
+// Asks kmemd to compact soon; called when an allocation of order failed.
+static void compact_request(int order) {
+    if (order > compact_pending_order) compact_pending_order = order;
+}
+
+// Called from kmemd: compact when a multi-page allocation has failed, or
+// when costly allocations would fail because of fragmentation rather than
+// lack of memory.
+static void compact_background(void) {
+    static uint32_t last_check = 0;
+    int pending = compact_pending_order;
+    if (pending > 0) {
+        compact_pending_order = -1;
+        for (int z = 0; z < MAX_NR_ZONES; z++) {
+            if (!zone_has_block(&zones[z], pending)) compact_zone(&zones[z], pending);
         }
     }
+    uint32_t now = get_ticks();
+    if (now - last_check < COMPACT_INTERVAL_TICKS) return;
+    last_check = now;
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        if (fragmentation_index(&zones[z], COMPACT_TRIGGER_ORDER) > FRAG_INDEX_THRESHOLD) {
+            compact_zone(&zones[z], COMPACT_TRIGGER_ORDER);
+        }
+    }
+}
+
+// Background memory maintenance. Idle only gets spare cycles, which a
+// CPU-bound batch task never leaves it, so this runs above PRIO_BATCH and
+// does a bounded batch of work per wakeup.
+#define KMEMD_BATCH 16   // Pages zeroed per round
+#define KMEMD_INTERVAL_MS (COMPACT_INTERVAL_TICKS * (NSEC_PER_TICK / 1000000))
+
+void kmemd_task(void) {
+    while (1) {
+        int zeroed = 0;
+        while (zeroed < KMEMD_BATCH && zero_pool_refill()) zeroed++;
+        compact_background();
+        // Come back soon while the pool is still filling
+        sleep(zeroed == KMEMD_BATCH ? 10 : KMEMD_INTERVAL_MS);
+    }
+}
+
+uint32_t pmm_get_free_memory(void) {
+    uint32_t total_free = 0;
+    for (int z = 0; z < MAX_NR_ZONES; z++) total_free += zones[z].free_pages * PAGE_SIZE;
     return total_free;
 }
 
+void zoneinfo_print(void) {
+    vga_print_string("\nzone    managed  free  min  low  frag\n");
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        Zone* zone = &zones[z];
+        vga_print_string(zone->name);
+        for (size_t pad = strlen(zone->name); pad < 8; pad++) vga_putchar(' ');
+        vga_print_dec(zone->managed_pages);
+        vga_print_string("  ");
+        vga_print_dec(zone->free_pages);
+        vga_print_string("  ");
+        vga_print_dec(zone->watermark_min);
+        vga_print_string("  ");
+        vga_print_dec(zone->watermark_low);
+        vga_print_string("  ");
+        int frag = fragmentation_index(zone, COMPACT_TRIGGER_ORDER);
+        if (frag < 0) vga_print_string("-");
+        else vga_print_dec(frag);
+        vga_print_string("\n");
+    }
+}
+
 // ==========================================
 // FILE: heap.c
 // ==========================================
-#define HEAP_ALIGNMENT 4
-#define HEAP_MAGIC 0x12345678
-
-typedef struct heap_segment_header{
-    uint32_t magic; 
-    size_t size;
-    bool free;
-    struct heap_segment_header* next;
-    struct heap_segment_header* prev;
+// Two-level segregated fit (TLSF) heap. Free blocks are binned by a
+// first-level (power of two) and second-level (linear subdivision) index;
+// two bitmaps find a suitable non-empty bin in O(1). Pools are requested
+// from the buddy allocator on demand and returned once completely free.
+// kmalloc only uses it for small requests with more than slab alignment.
+#define HEAP_ALIGNMENT      16
+#define HEAP_MAGIC          0x12345678
+#define HEAP_SL_LOG2        5
+#define HEAP_SL_COUNT       (1 << HEAP_SL_LOG2)
+#define HEAP_FL_SHIFT       (HEAP_SL_LOG2 + 4)              // log2(HEAP_ALIGNMENT) = 4
+#define HEAP_SMALL_BLOCK    (1 << HEAP_FL_SHIFT)            // Below this, bins are linear
+#define HEAP_FL_MAX         32
+#define HEAP_FL_COUNT       (HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+#define HEAP_MIN_PAYLOAD    (2 * sizeof(void*))             // Room for the free-list links
+#define HEAP_POOL_MIN_ORDER 6                               // Grow by at least 256 KB
+
+#define HEAP_BLOCK_FREE     0x1
+#define HEAP_BLOCK_SENTINEL 0x2                             // Terminates a pool
+
+typedef struct heap_block_header {
+    uint32_t magic;
+    uint32_t flags;
+    size_t size;                               // Payload bytes following the header
+    struct heap_block_header* prev_phys;       // Physically preceding block, NULL at pool start
+    uint64_t reserved;                         // Keeps payloads HEAP_ALIGNMENT aligned
+    // Free blocks keep their bin links at the start of the payload
 } heap_header_t;
 
-static void* heap_start_address = NULL;
-static size_t heap_size = 0;
-static heap_header_t* first_segment = NULL;
+typedef struct {
+    heap_header_t* next_free;
+    heap_header_t* prev_free;
+} heap_links_t;
+
+static uint32_t heap_fl_bitmap = 0;
+static uint32_t heap_sl_bitmap[HEAP_FL_COUNT];
+static heap_header_t* heap_bins[HEAP_FL_COUNT][HEAP_SL_COUNT];
+static uint32_t heap_pools = 0;
 static spinlock_t heap_lock;
 
 static inline size_t align(size_t size) {
     return (size + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
 }
 
-void heap_init(uintptr_t start_address, uint32_t size){
-    if (size < sizeof(heap_header_t) + HEAP_ALIGNMENT) return;
-    heap_start_address = (void*)((uintptr_t)start_address);
-    heap_size = size;
-    first_segment = (heap_header_t*)heap_start_address;
+static inline heap_links_t* heap_links(heap_header_t* block) {
+    return (heap_links_t*)((uint8_t*)block + sizeof(heap_header_t));
+}
+
+static inline heap_header_t* heap_next_phys(heap_header_t* block) {
+    return (heap_header_t*)((uint8_t*)block + sizeof(heap_header_t) + block->size);
+}
+
+static inline int heap_fls(size_t x) { return 63 - __builtin_clzl(x); }
+
+static void heap_mapping(size_t size, int* fl, int* sl) {
+    if (size < HEAP_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (HEAP_SMALL_BLOCK / HEAP_SL_COUNT);
+    } else {
+        int f = heap_fls(size);
+        *sl = (size >> (f - HEAP_SL_LOG2)) ^ HEAP_SL_COUNT;
+        *fl = f - HEAP_FL_SHIFT + 1;
+    }
+}
+
+// Rounds the request up to the next bin boundary so any block found there fits.
+static size_t heap_round_up(size_t size) {
+    if (size < HEAP_SMALL_BLOCK) return size;
+    return size + ((size_t)1 << (heap_fls(size) - HEAP_SL_LOG2)) - 1;
+}
+
+static void heap_insert(heap_header_t* block) {
+    int fl, sl;
+    heap_mapping(block->size, &fl, &sl);
+    heap_links_t* links = heap_links(block);
+    links->prev_free = NULL;
+    links->next_free = heap_bins[fl][sl];
+    if (links->next_free) heap_links(links->next_free)->prev_free = block;
+    heap_bins[fl][sl] = block;
+    heap_fl_bitmap |= 1u << fl;
+    heap_sl_bitmap[fl] |= 1u << sl;
+    block->flags |= HEAP_BLOCK_FREE;
+}
+
+static void heap_remove(heap_header_t* block) {
+    int fl, sl;
+    heap_mapping(block->size, &fl, &sl);
+    heap_links_t* links = heap_links(block);
+    if (links->prev_free) heap_links(links->prev_free)->next_free = links->next_free;
+    else heap_bins[fl][sl] = links->next_free;
+    if (links->next_free) heap_links(links->next_free)->prev_free = links->prev_free;
+    if (!heap_bins[fl][sl]) {
+        heap_sl_bitmap[fl] &= ~(1u << sl);
+        if (!heap_sl_bitmap[fl]) heap_fl_bitmap &= ~(1u << fl);
+    }
+    block->flags &= ~HEAP_BLOCK_FREE;
+}
+
+static heap_header_t* heap_find(size_t size) {
+    int fl, sl;
+    heap_mapping(heap_round_up(size), &fl, &sl);
+    if (fl >= HEAP_FL_COUNT) return NULL;
+    uint32_t sl_map = heap_sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = (fl + 1 < 32) ? heap_fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (!fl_map) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = heap_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return heap_bins[fl][sl];
+}
+
+// Requests a new pool from the buddy allocator big enough for `size`.
+static bool heap_grow(size_t size) {
+    size_t needed = heap_round_up(size) + 2 * sizeof(heap_header_t);
+    int order = HEAP_POOL_MIN_ORDER;
+    while (((size_t)PAGE_SIZE << order) < needed) order++;
+    if (order >= MAX_ORDER) return false;
+
+    Page* page = alloc_pages(order);
+    if (!page) return false;
+    for (uint32_t i = 0; i < (1u << order); i++) page[i].flags |= PAGE_FLAG_USED | PAGE_FLAG_HEAP;
+
+    size_t bytes = (size_t)PAGE_SIZE << order;
+    heap_header_t* block = (heap_header_t*)page_to_phys(page);
+    block->magic = HEAP_MAGIC;
+    block->flags = 0;
+    block->size = bytes - 2 * sizeof(heap_header_t);
+    block->prev_phys = NULL;
+
+    heap_header_t* sentinel = heap_next_phys(block);
+    sentinel->magic = HEAP_MAGIC;
+    sentinel->flags = HEAP_BLOCK_SENTINEL;
+    sentinel->size = 0;
+    sentinel->prev_phys = block;
+
+    heap_insert(block);
+    heap_pools++;
+    return true;
+}
+
+static void heap_release_pool(heap_header_t* block) {
+    size_t bytes = block->size + 2 * sizeof(heap_header_t);
+    Page* page = phys_to_page((uintptr_t)block);
+    int order = 0;
+    while (((size_t)PAGE_SIZE << order) < bytes) order++;
+    for (uint32_t i = 0; i < (1u << order); i++) page[i].flags = 0;
+    page->flags = PAGE_FLAG_USED;
+    free_pages(page, order);
+    heap_pools--;
+}
+
+// Splits off the tail of an allocated block if it can hold another block,
+// merging it with a free successor.
+static void heap_trim(heap_header_t* block, size_t size) {
+    if (block->size < size + sizeof(heap_header_t) + HEAP_MIN_PAYLOAD) return;
+    heap_header_t* rest = (heap_header_t*)((uint8_t*)block + sizeof(heap_header_t) + size);
+    rest->magic = HEAP_MAGIC;
+    rest->flags = 0;
+    rest->size = block->size - size - sizeof(heap_header_t);
+    rest->prev_phys = block;
+    block->size = size;
+    heap_header_t* next = heap_next_phys(rest);
+    if (next->flags & HEAP_BLOCK_FREE) {
+        heap_remove(next);
+        rest->size += sizeof(heap_header_t) + next->size;
+        next = heap_next_phys(rest);
+    }
+    next->prev_phys = rest;
+    heap_insert(rest);
+}
+
+void heap_init(void) {
     spinlock_init(&heap_lock);
-    first_segment->magic = HEAP_MAGIC;
-    first_segment->size = size - sizeof(heap_header_t);
-    first_segment->free = true;
-    first_segment->next = NULL;
-    first_segment->prev = NULL;
+    heap_fl_bitmap = 0;
+    memset(heap_sl_bitmap, 0, sizeof(heap_sl_bitmap));
+    memset(heap_bins, 0, sizeof(heap_bins));
+    heap_pools = 0;
+    heap_grow(0);
 }
 
 void* heap_alloc(size_t size){
-    spinlock_acquire(&heap_lock);
-    if (size == 0) {
-        spinlock_release(&heap_lock);
+    if (size == 0) return NULL;
+    size_t aligned_size = align(size);
+    if (aligned_size < HEAP_MIN_PAYLOAD) aligned_size = HEAP_MIN_PAYLOAD;
+
+    unsigned long flags = spinlock_acquire_irqsave(&heap_lock);
+    heap_header_t* block = heap_find(aligned_size);
+    if (!block && heap_grow(aligned_size)) block = heap_find(aligned_size);
+    if (!block) {
+        spinlock_release_irqrestore(&heap_lock, flags);
         return NULL;
     }
+    heap_remove(block);
+    heap_trim(block, aligned_size);
+    spinlock_release_irqrestore(&heap_lock, flags);
+    return (void*)((uint8_t*)block + sizeof(heap_header_t));
+}
+
+// Like heap_alloc, but the payload starts on an `alignment` boundary. The
+// leading gap is split off as a free block rather than wasted.
+void* heap_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment <= HEAP_ALIGNMENT) return heap_alloc(size);
+    if (size == 0) return NULL;
     size_t aligned_size = align(size);
-    heap_header_t* current = first_segment;
-    while (current != NULL) {
-        if (current->free && current->size >= aligned_size) {
-            if (current->size >= aligned_size + sizeof(heap_header_t) + HEAP_ALIGNMENT) { 
-                heap_header_t* new_segment = (heap_header_t*)((uint8_t*)current + sizeof(heap_header_t) + aligned_size);
-                new_segment->magic = HEAP_MAGIC;
-                new_segment->size = current->size - aligned_size - sizeof(heap_header_t);
-                new_segment->free = true;
-                new_segment->next = current->next;
-                new_segment->prev = current;
-
-                if (current->next != NULL) current->next->prev = new_segment;
-                current->next = new_segment;
-                current->size = aligned_size;
-            }
-            current->free = false;
-            spinlock_release(&heap_lock);
-            return (void*)((uint8_t*)current + sizeof(heap_header_t));
+    if (aligned_size < HEAP_MIN_PAYLOAD) aligned_size = HEAP_MIN_PAYLOAD;
+    size_t gap_min = sizeof(heap_header_t) + HEAP_MIN_PAYLOAD;
+    size_t search = aligned_size + alignment + gap_min;
+
+    unsigned long flags = spinlock_acquire_irqsave(&heap_lock);
+    heap_header_t* block = heap_find(search);
+    if (!block && heap_grow(search)) block = heap_find(search);
+    if (!block) {
+        spinlock_release_irqrestore(&heap_lock, flags);
+        return NULL;
+    }
+    heap_remove(block);
+
+    uintptr_t payload = (uintptr_t)block + sizeof(heap_header_t);
+    uintptr_t aligned = align_up(payload, alignment);
+    if (aligned != payload && aligned - payload < gap_min) aligned = align_up(payload + gap_min, alignment);
+    if (aligned != payload) {
+        size_t gap = aligned - payload;
+        heap_header_t* body = (heap_header_t*)(aligned - sizeof(heap_header_t));
+        body->magic = HEAP_MAGIC;
+        body->flags = 0;
+        body->size = block->size - gap;
+        body->prev_phys = block;
+        heap_next_phys(body)->prev_phys = body;
+        block->size = gap - sizeof(heap_header_t);
+        heap_insert(block); // Its physical predecessor is in use, so no coalescing needed
+        block = body;
+    }
+    heap_trim(block, aligned_size);
+    spinlock_release_irqrestore(&heap_lock, flags);
+    return (void*)aligned;
+}
+
+// Resizes a heap block without moving it, growing into a free successor if
+// needed. Returns false if the block has to move.
+bool heap_resize(void* ptr, size_t size) {
+    heap_header_t* block = (heap_header_t*)((uint8_t*)ptr - sizeof(heap_header_t));
+    size_t aligned_size = align(size);
+    if (aligned_size < HEAP_MIN_PAYLOAD) aligned_size = HEAP_MIN_PAYLOAD;
+
+    unsigned long flags = spinlock_acquire_irqsave(&heap_lock);
+    if (block->magic != HEAP_MAGIC || (block->flags & (HEAP_BLOCK_FREE | HEAP_BLOCK_SENTINEL))) {
+        spinlock_release_irqrestore(&heap_lock, flags);
+        return false;
+    }
+    if (aligned_size > block->size) {
+        heap_header_t* next = heap_next_phys(block);
+        if (!(next->flags & HEAP_BLOCK_FREE) ||
+            block->size + sizeof(heap_header_t) + next->size < aligned_size) {
+            spinlock_release_irqrestore(&heap_lock, flags);
+            return false;
         }
-        current = current->next;
+        heap_remove(next);
+        block->size += sizeof(heap_header_t) + next->size;
+        heap_next_phys(block)->prev_phys = block;
     }
-    spinlock_release(&heap_lock);
-    return NULL;
+    heap_trim(block, aligned_size);
+    spinlock_release_irqrestore(&heap_lock, flags);
+    return true;
+}
+
+size_t heap_block_size(void* ptr) {
+    return ((heap_header_t*)((uint8_t*)ptr - sizeof(heap_header_t)))->size;
 }
 
 void heap_free(void* ptr){
-    spinlock_acquire(&heap_lock);
-    if (ptr == NULL) {
-        spinlock_release(&heap_lock);
+    if (ptr == NULL) return;
+    heap_header_t* block = (heap_header_t*)((uint8_t*)ptr - sizeof(heap_header_t));
+    unsigned long flags = spinlock_acquire_irqsave(&heap_lock);
+    if (block->magic != HEAP_MAGIC || (block->flags & (HEAP_BLOCK_FREE | HEAP_BLOCK_SENTINEL))) {
+        spinlock_release_irqrestore(&heap_lock, flags);
         return;
     }
-    heap_header_t* header = (heap_header_t*)((uint8_t*)ptr - sizeof(heap_header_t));
-    if (header->magic != HEAP_MAGIC) {
-        spinlock_release(&heap_lock);
-        return; 
-    }
 
-    header->free = true;
-    heap_header_t* next = header->next;
-    if (next != NULL && next->free) {
-        header->size += sizeof(heap_header_t) + next->size;
-        header->next = next->next;
-        if (next->next != NULL) next->next->prev = header;
+    // Immediate coalescing with both physical neighbours
+    heap_header_t* next = heap_next_phys(block);
+    if (next->flags & HEAP_BLOCK_FREE) {
+        heap_remove(next);
+        block->size += sizeof(heap_header_t) + next->size;
+        heap_next_phys(block)->prev_phys = block;
+    }
+    heap_header_t* prev = block->prev_phys;
+    if (prev && (prev->flags & HEAP_BLOCK_FREE)) {
+        heap_remove(prev);
+        prev->size += sizeof(heap_header_t) + block->size;
+        heap_next_phys(prev)->prev_phys = prev;
+        block = prev;
     }
 
-    heap_header_t* prev = header->prev;
-    if (prev != NULL && prev->free) {
-        prev->size += sizeof(heap_header_t) + header->size;
-        prev->next = header->next;
-        if (prev->next != NULL) prev->next->prev = prev;
+    // Hand a completely free pool back to the PMM, keeping one around
+    if (!block->prev_phys && (heap_next_phys(block)->flags & HEAP_BLOCK_SENTINEL) && heap_pools > 1) {
+        heap_release_pool(block);
+    } else {
+        heap_insert(block);
     }
-    spinlock_release(&heap_lock);
+    spinlock_release_irqrestore(&heap_lock, flags);
 }
 
-void* kmalloc(size_t size) { return heap_alloc(size); }
-void kfree(void* ptr) { heap_free(ptr); }
+// --- kmalloc: size classes backed by slab caches ---
+// Requests up to KMALLOC_MAX_SIZE come from power-of-two (and 3*2^n) slab
+// caches; anything larger is a whole buddy block (kmalloc_large).
+#define KMALLOC_MAX_SIZE 4096
+#define KMALLOC_CACHES   16
 
-// Wrappers for Standard Library compatibility
-void* malloc(size_t size) { return kmalloc(size); }
-void free(void* ptr) { kfree(ptr); }
+static const uint32_t kmalloc_sizes[KMALLOC_CACHES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+static const char* kmalloc_names[KMALLOC_CACHES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64", "kmalloc-96", "kmalloc-128",
+    "kmalloc-192", "kmalloc-256", "kmalloc-384", "kmalloc-512", "kmalloc-768",
+    "kmalloc-1024", "kmalloc-1536", "kmalloc-2048", "kmalloc-3072", "kmalloc-4096"
+};
+static Cache kmalloc_caches[KMALLOC_CACHES];
 
-// ==========================================
+// Size class index in O(1): size lies in (2^(n-1), 2^n], and the 3*2^(n-2)
+// class splits that range in two.
+static inline int kmalloc_index(size_t size) {
+    if (size <= 16) return 0;
+    int n = 64 - __builtin_clzl(size - 1);
+    if (n >= 6 && size <= (3ul << (n - 2))) return 2 * n - 10;
+    return 2 * n - 9;
+}
+
+void kmalloc_init(void) {
+    for (int i = 0; i < KMALLOC_CACHES; i++) {
+        kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], kmalloc_sizes[i], NULL, NULL);
+    }
+}
+
+// Whole pages straight from the buddy allocator, page aligned.
+static void* kmalloc_large(size_t size) {
+    int order = 0;
+    while (((size_t)PAGE_SIZE << order) < size) order++;
+    if (order >= MAX_ORDER) return NULL;
+    Page* page = alloc_pages(order);
+    if (!page) return NULL;
+    for (uint32_t i = 0; i < (1u << order); i++) page[i].flags |= PAGE_FLAG_USED | PAGE_FLAG_KMALLOC;
+    page->order = (uint8_t)order;
+    return (void*)page_to_phys(page);
+}
+
+static void kfree_large(Page* page) {
+    int order = page->order;
+    for (uint32_t i = 0; i < (1u << order); i++) page[i].flags = 0;
+    page->flags = PAGE_FLAG_USED;
+    free_pages(page, order);
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0) return NULL;
+    if (size > KMALLOC_MAX_SIZE) return kmalloc_large(size);
+    return kmem_cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+    // The page descriptor tells us whether this came from a slab, whole
+    // pages or a heap pool
+    Page* page = phys_to_page((uintptr_t)ptr);
+    if (!page) return;
+    if (page->slab) {
+        kmem_cache_free(page->slab->cache, ptr);
+    } else if (page->flags & PAGE_FLAG_KMALLOC) {
+        kfree_large(page);
+    } else if (page->flags & PAGE_FLAG_HEAP) {
+        heap_free(ptr);
+    }
+}
+
+// Usable size of an allocation (may exceed what was requested).
+size_t ksize(void* ptr) {
+    if (!ptr) return 0;
+    Page* page = phys_to_page((uintptr_t)ptr);
+    if (!page) return 0;
+    if (page->slab) return page->slab->cache->obj_size;
+    if (page->flags & PAGE_FLAG_KMALLOC) return (size_t)PAGE_SIZE << page->order;
+    if (page->flags & PAGE_FLAG_HEAP) return heap_block_size(ptr);
+    return 0;
+}
+
+// Alignment must be a power of two no larger than PAGE_SIZE.
+void* kmalloc_aligned(size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) || alignment > PAGE_SIZE) return NULL;
+    if (alignment <= SLAB_OBJ_ALIGN || size > KMALLOC_MAX_SIZE) return kmalloc(size);
+    return heap_alloc_aligned(size, alignment);
+}
+
+void* kcalloc(size_t count, size_t size) {
+    if (size && count > (size_t)-1 / size) return NULL;
+    void* ptr = kmalloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) return kmalloc(size);
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+    size_t old_size = ksize(ptr);
+    if (old_size == 0) return NULL;
+
+    // Slab objects and page blocks already have room up to their class
+    // size; heap blocks try to grow into the adjacent free block first
+    Page* page = phys_to_page((uintptr_t)ptr);
+    if (page->slab || (page->flags & PAGE_FLAG_KMALLOC)) {
+        if (size <= old_size) return ptr;
+    } else if (heap_resize(ptr, size)) {
+        return ptr;
+    }
+
+    void* new_ptr = kmalloc(size);
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    kfree(ptr);
+    return new_ptr;
+}
+
+// Wrappers for Standard Library compatibility
+void* malloc(size_t size) { return kmalloc(size); }
+void free(void* ptr) { kfree(ptr); }
+
+// ==========================================
 // FILE: paging.c
 // ==========================================
 #define PTE_PRESENT 1
 #define PTE_RW      2
 #define PTE_USER    4
+#define PTE_PWT     0x08
+#define PTE_PCD     0x10
+#define PTE_HUGE    0x80    // PS bit: 2 MB page in a PD entry, 1 GB page in a PDPT entry
+#define PTE_GLOBAL  0x100   // Survives CR3 switches (needs CR4.PGE)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
 
 typedef struct {
     uint64_t entries[512];
 } pt_t;
 
-pt_t* kernel_pml4 = NULL;
+#define CR4_PGE   (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+#define CR3_NOFLUSH (1ULL << 63)   // With PCIDE: keep the new PCID's TLB entries
+#define PCID_COUNT 4096
+
+#define INVPCID_SINGLE_CONTEXT 1
+#define INVPCID_ALL_GLOBAL     2
+
+pt_t* kernel_pml4 = NULL;
+static bool cpu_has_1g_pages = false;
+static bool cpu_has_pge = false;
+static bool cpu_has_pcid = false;
+static bool cpu_has_invpcid = false;
+static uint64_t pte_global = 0;     // PTE_GLOBAL once CR4.PGE is on
+
+// PML4 slot 0 (the direct map) and the upper half are shared by every
+// address space; slots 1..255 are private to each one.
+static inline bool pml4_slot_shared(uint64_t idx) {
+    return idx == 0 || idx >= 256;
+}
+
+// Returns the table an entry points to, allocating it if missing. A huge page
+// in the way is split into a table of next-smaller pages with the same flags.
+static pt_t* paging_next_level(uint64_t* entry, uint64_t child_size) {
+    if (!(*entry & PTE_PRESENT)) {
+        pt_t* table = (pt_t*)alloc_zeroed_page();
+        *entry = (uint64_t)table | PTE_PRESENT | PTE_RW | PTE_USER;
+    } else if (*entry & PTE_HUGE) {
+        uint64_t base = *entry & PTE_ADDR_MASK & ~(child_size * 512 - 1);
+        uint64_t flags = *entry & ~PTE_ADDR_MASK;
+        pt_t* table = (pt_t*)pmm_alloc_page();
+        // 4 KB entries have no PS bit; 2 MB entries keep it
+        if (child_size == PAGE_SIZE) flags &= ~PTE_HUGE;
+        for (int i = 0; i < 512; i++) table->entries[i] = (base + i * child_size) | flags;
+        *entry = (uint64_t)table | PTE_PRESENT | PTE_RW | PTE_USER;
+    }
+    return (pt_t*)(*entry & PTE_ADDR_MASK);
+}
+
+static inline void invlpg(uint64_t virt) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t virt) {
+    struct { uint64_t pcid; uint64_t addr; } desc = { pcid, virt };
+    __asm__ __volatile__("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+// Kernel mappings are global, so a CR3 reload alone would keep them.
+// Flush every PCID including global entries.
+static inline void tlb_flush_all(void) {
+    if (cpu_has_invpcid) {
+        invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+    } else if (pte_global) {
+        uint64_t cr4;
+        __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ __volatile__("mov %0, %%cr4; mov %1, %%cr4" : : "r"(cr4 & ~CR4_PGE), "r"(cr4) : "memory");
+    } else {
+        uint64_t cr3;
+        __asm__ __volatile__("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    }
+}
+
+// For the TLB shootdown and un-park IPIs.
+void tlb_flush_local(void) {
+    tlb_flush_all();
+}
+
+// --- TLB flush batching ---
+// Range operations collect the addresses they touched; a handful get
+// individual invlpg, anything beyond TLB_FLUSH_THRESHOLD reloads CR3.
+void tlb_batch_add(tlb_batch_t* batch, uint64_t virt) {
+    if (batch->count < TLB_FLUSH_THRESHOLD) batch->pages[batch->count] = virt;
+    batch->count++;
+}
+
+void tlb_batch_flush(tlb_batch_t* batch) {
+    if (batch->count == 0) return;
+    if (batch->count > TLB_FLUSH_THRESHOLD) {
+        tlb_flush_all();
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) invlpg(batch->pages[i]);
+    }
+    batch->count = 0;
+    smp_tlb_shootdown();   // Kernel mappings are cached by every CPU
+}
+
+// Installs a 4 KB PTE without flushing. Returns true if it replaced a present one.
+static bool paging_set(uint64_t phys, uint64_t virt, uint64_t flags) {
+    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
+    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
+    uint64_t pd_idx   = (virt >> 21) & 0x1FF;
+    uint64_t pt_idx   = (virt >> 12) & 0x1FF;
+
+    pt_t* pdpt = paging_next_level(&kernel_pml4->entries[pml4_idx], PAGE_SIZE_1G);
+    pt_t* pd = paging_next_level(&pdpt->entries[pdpt_idx], PAGE_SIZE_2M);
+    pt_t* pt = paging_next_level(&pd->entries[pd_idx], PAGE_SIZE);
+
+    bool was_present = pt->entries[pt_idx] & PTE_PRESENT;
+    pt->entries[pt_idx] = phys | flags | pte_global;
+    return was_present;
+}
+
+void paging_map(uint64_t phys, uint64_t virt, uint64_t flags) {
+    if (!kernel_pml4) return;
+    if (paging_set(phys, virt, flags)) {
+        invlpg(virt);
+        smp_tlb_shootdown();
+    }
+}
+
+static bool table_empty(pt_t* table) {
+    for (int i = 0; i < 512; i++) if (table->entries[i]) return false;
+    return true;
+}
+
+// Walks [virt, virt+size) once, touching each page table a single time.
+// MAP installs phys-backed entries (huge pages when alignment allows),
+// UNMAP clears entries and frees tables that become empty, PROTECT
+// rewrites the flags of present entries. Kernel mappings are made global.
+static void paging_walk_range(pt_t* root, uint64_t virt, uint64_t size, uint64_t phys, uint64_t flags,
+                              paging_op_t op, tlb_batch_t* batch) {
+    uint64_t va = virt & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = virt + size;
+    int64_t delta = (int64_t)(phys - va);  // phys = va + delta for MAP
+    if (root == kernel_pml4 && op != PAGING_UNMAP) flags |= pte_global;
+
+    while (va < end) {
+        uint64_t pml4_idx = (va >> 39) & 0x1FF;
+        uint64_t* pml4e = &root->entries[pml4_idx];
+        if (op != PAGING_MAP && !(*pml4e & PTE_PRESENT)) {
+            va = (va | ((1ULL << 39) - 1)) + 1;
+            continue;
+        }
+        pt_t* pdpt = paging_next_level(pml4e, PAGE_SIZE_1G);
+
+        // 1 GB level
+        uint64_t* pdpte = &pdpt->entries[(va >> 30) & 0x1FF];
+        bool whole_1g = !(va & (PAGE_SIZE_1G - 1)) && end - va >= PAGE_SIZE_1G;
+        if (op == PAGING_MAP && whole_1g && cpu_has_1g_pages && !((va + delta) & (PAGE_SIZE_1G - 1)) &&
+            (!(*pdpte & PTE_PRESENT) || (*pdpte & PTE_HUGE))) {
+            if (*pdpte & PTE_PRESENT) tlb_batch_add(batch, va);
+            *pdpte = (va + delta) | flags | PTE_HUGE;
+            va += PAGE_SIZE_1G;
+            continue;
+        }
+        if ((*pdpte & PTE_PRESENT) && (*pdpte & PTE_HUGE) && whole_1g && op != PAGING_MAP) {
+            *pdpte = (op == PAGING_UNMAP) ? 0 : (*pdpte & PTE_ADDR_MASK) | flags | PTE_HUGE;
+            tlb_batch_add(batch, va);
+            va += PAGE_SIZE_1G;
+            continue;
+        }
+        if (op != PAGING_MAP && !(*pdpte & PTE_PRESENT)) {
+            va = (va | (PAGE_SIZE_1G - 1)) + 1;
+            continue;
+        }
+        pt_t* pd = paging_next_level(pdpte, PAGE_SIZE_2M);
+
+        // 2 MB level
+        uint64_t* pde = &pd->entries[(va >> 21) & 0x1FF];
+        bool whole_2m = !(va & (PAGE_SIZE_2M - 1)) && end - va >= PAGE_SIZE_2M;
+        if (op == PAGING_MAP && whole_2m && !((va + delta) & (PAGE_SIZE_2M - 1)) &&
+            (!(*pde & PTE_PRESENT) || (*pde & PTE_HUGE))) {
+            if (*pde & PTE_PRESENT) tlb_batch_add(batch, va);
+            *pde = (va + delta) | flags | PTE_HUGE;
+            va += PAGE_SIZE_2M;
+            continue;
+        }
+        if ((*pde & PTE_PRESENT) && (*pde & PTE_HUGE) && whole_2m && op != PAGING_MAP) {
+            *pde = (op == PAGING_UNMAP) ? 0 : (*pde & PTE_ADDR_MASK) | flags | PTE_HUGE;
+            tlb_batch_add(batch, va);
+            va += PAGE_SIZE_2M;
+        } else if (op != PAGING_MAP && !(*pde & PTE_PRESENT)) {
+            va = (va | (PAGE_SIZE_2M - 1)) + 1;
+        } else {
+            // 4 KB level: fill or clear this table's slice of the range in one pass
+            pt_t* pt = paging_next_level(pde, PAGE_SIZE);
+            uint64_t pt_end = (va | (PAGE_SIZE_2M - 1)) + 1;
+            if (pt_end > end) pt_end = end;
+            for (; va < pt_end; va += PAGE_SIZE) {
+                uint64_t* pte = &pt->entries[(va >> 12) & 0x1FF];
+                if (op == PAGING_MAP) {
+                    if (*pte & PTE_PRESENT) tlb_batch_add(batch, va);
+                    *pte = (va + delta) | flags;
+                } else if (*pte & PTE_PRESENT) {
+                    *pte = (op == PAGING_UNMAP) ? 0 : (*pte & PTE_ADDR_MASK) | flags;
+                    tlb_batch_add(batch, va);
+                }
+            }
+            if (op == PAGING_UNMAP && table_empty(pt)) {
+                *pde = 0;
+                pmm_free_page(pt);
+            }
+        }
+
+        // Give emptied intermediate tables back to the PMM
+        if (op == PAGING_UNMAP && table_empty(pd)) {
+            *pdpte = 0;
+            pmm_free_page(pd);
+            // Shared slots are referenced by every address space; keep them
+            if (table_empty(pdpt) && !pml4_slot_shared(pml4_idx)) {
+                *pml4e = 0;
+                pmm_free_page(pdpt);
+            }
+        }
+    }
+}
+
+void paging_map_range(uint64_t phys, uint64_t virt, uint64_t size, uint64_t flags) {
+    if (!kernel_pml4 || size == 0) return;
+    tlb_batch_t batch = { .count = 0 };
+    paging_walk_range(kernel_pml4, virt, size, phys, flags, PAGING_MAP, &batch);
+    tlb_batch_flush(&batch);
+}
+
+void paging_unmap_range(uint64_t virt, uint64_t size) {
+    if (!kernel_pml4 || size == 0) return;
+    tlb_batch_t batch = { .count = 0 };
+    paging_walk_range(kernel_pml4, virt, size, 0, 0, PAGING_UNMAP, &batch);
+    tlb_batch_flush(&batch);
+}
+
+void paging_protect_range(uint64_t virt, uint64_t size, uint64_t flags) {
+    if (!kernel_pml4 || size == 0) return;
+    tlb_batch_t batch = { .count = 0 };
+    paging_walk_range(kernel_pml4, virt, size, 0, flags | PTE_PRESENT, PAGING_PROTECT, &batch);
+    tlb_batch_flush(&batch);
+}
+
+void paging_unmap(uint64_t virt) {
+    paging_unmap_range(virt, PAGE_SIZE);
+}
+
+// Returns the PTE for a 4 KB mapping, or NULL if no page table covers virt
+// (or it is covered by a huge page).
+static uint64_t* paging_get_pte(uint64_t virt) {
+    if (!kernel_pml4) return NULL;
+    uint64_t e = kernel_pml4->entries[(virt >> 39) & 0x1FF];
+    if (!(e & PTE_PRESENT)) return NULL;
+    e = ((pt_t*)(e & PTE_ADDR_MASK))->entries[(virt >> 30) & 0x1FF];
+    if (!(e & PTE_PRESENT) || (e & PTE_HUGE)) return NULL;
+    e = ((pt_t*)(e & PTE_ADDR_MASK))->entries[(virt >> 21) & 0x1FF];
+    if (!(e & PTE_PRESENT) || (e & PTE_HUGE)) return NULL;
+    return &((pt_t*)(e & PTE_ADDR_MASK))->entries[(virt >> 12) & 0x1FF];
+}
+
+// Moves a movable kernel page: copies it to new_phys and repoints the PTE.
+// Fails if virt no longer maps old_phys. Caller keeps interrupts off.
+bool paging_migrate_page(uintptr_t virt, uint64_t old_phys, uint64_t new_phys) {
+    uint64_t* pte = paging_get_pte(virt);
+    if (!pte || !(*pte & PTE_PRESENT) || (*pte & PTE_ADDR_MASK) != old_phys) return false;
+    memcpy((void*)new_phys, (void*)old_phys, PAGE_SIZE);
+    *pte = new_phys | (*pte & ~PTE_ADDR_MASK);
+    invlpg(virt);
+    return true;
+}
+
+// --- Address spaces ---
+// Each address space owns a PML4 whose shared slots point at the kernel's
+// tables, so kernel mappings made later show up everywhere. With PCID every
+// space gets its own TLB tag and switches keep the cached translations.
+address_space_t kernel_address_space;
+static uint64_t pcid_bitmap[PCID_COUNT / 64];
+static spinlock_t pcid_lock;
+
+static uint16_t pcid_alloc(void) {
+    if (!cpu_has_pcid) return 0;
+    unsigned long irq = spinlock_acquire_irqsave(&pcid_lock);
+    for (int i = 0; i < PCID_COUNT / 64; i++) {
+        if (pcid_bitmap[i] == ~0ULL) continue;
+        int bit = __builtin_ctzll(~pcid_bitmap[i]);
+        pcid_bitmap[i] |= 1ULL << bit;
+        spinlock_release_irqrestore(&pcid_lock, irq);
+        return (uint16_t)(i * 64 + bit);
+    }
+    spinlock_release_irqrestore(&pcid_lock, irq);
+    return 0; // Out of tags: share the kernel's and flush on every switch
+}
+
+static void pcid_free(uint16_t pcid) {
+    if (pcid == 0) return;
+    // Drop whatever the TLB still holds under this tag before reuse
+    if (cpu_has_invpcid) invpcid(INVPCID_SINGLE_CONTEXT, pcid, 0);
+    else tlb_flush_all();
+    unsigned long irq = spinlock_acquire_irqsave(&pcid_lock);
+    pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spinlock_release_irqrestore(&pcid_lock, irq);
+}
+
+address_space_t* as_create(void) {
+    address_space_t* as = (address_space_t*)kmalloc(sizeof(address_space_t));
+    if (!as) return NULL;
+    pt_t* pml4 = (pt_t*)pmm_alloc_page();
+    if (!pml4) {
+        kfree(as);
+        return NULL;
+    }
+    for (int i = 0; i < 512; i++) pml4->entries[i] = pml4_slot_shared(i) ? kernel_pml4->entries[i] : 0;
+    as->pml4 = pml4->entries;
+    as->pcid = pcid_alloc();
+    // A recycled tag may still have entries cached on any CPU
+    as->tlb_stale = ~0u;
+    as->refcount = 1;
+    return as;
+}
+
+address_space_t* as_get(address_space_t* as) {
+    __atomic_add_fetch(&as->refcount, 1, __ATOMIC_RELAXED);
+    return as;
+}
+
+// Drops a reference. The last one frees the private page tables (not the
+// frames they map, which belong to whoever mapped them) and the PCID.
+void as_put(address_space_t* as) {
+    if (as == &kernel_address_space) return;
+    if (__atomic_sub_fetch(&as->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    tlb_batch_t batch = { .count = 0 };
+    paging_walk_range((pt_t*)as->pml4, USER_SPACE_START, USER_SPACE_END - USER_SPACE_START, 0, 0, PAGING_UNMAP, &batch);
+    pcid_free(as->pcid);
+    pmm_free_page(as->pml4);
+    kfree(as);
+}
+
+// Applies a change to the private half. CPUs that do not have the space
+// loaded get its TLB tag marked stale and flush on their next switch;
+// CPUs running it now are shot down.
+static void as_walk(address_space_t* as, uint64_t virt, uint64_t size, uint64_t phys, uint64_t flags, paging_op_t op) {
+    if (size == 0 || virt < USER_SPACE_START || virt + size > USER_SPACE_END) return;
+    tlb_batch_t batch = { .count = 0 };
+    paging_walk_range((pt_t*)as->pml4, virt, size, phys, flags, op, &batch);
+    if (batch.count == 0) return;
+    bool loaded = as == this_cpu()->active_as;
+    uint32_t self = 1u << smp_processor_id();
+    __atomic_or_fetch(&as->tlb_stale, loaded ? ~self : ~0u, __ATOMIC_RELEASE);
+    if (loaded) {
+        tlb_batch_flush(&batch);   // Also shoots down the other CPUs
+        return;
+    }
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        if (cpus[i].active_as == as) {
+            smp_tlb_shootdown();
+            break;
+        }
+    }
+}
+
+void as_map_range(address_space_t* as, uint64_t phys, uint64_t virt, uint64_t size, uint64_t flags) {
+    as_walk(as, virt, size, phys, flags, PAGING_MAP);
+}
+
+void as_unmap_range(address_space_t* as, uint64_t virt, uint64_t size) {
+    as_walk(as, virt, size, 0, 0, PAGING_UNMAP);
+}
+
+void as_switch(address_space_t* as) {
+    cpu_t* cpu = this_cpu();
+    if (as == cpu->active_as) return;
+    uint32_t mask = 1u << cpu->id;
+    bool stale = __atomic_fetch_and(&as->tlb_stale, ~mask, __ATOMIC_ACQUIRE) & mask;
+    uint64_t cr3 = (uint64_t)as->pml4;
+    if (cpu_has_pcid) {
+        cr3 |= as->pcid;
+        // Tag 0 is shared by the kernel and any space that ran out of tags
+        if (as->pcid != 0 && !stale) cr3 |= CR3_NOFLUSH;
+    }
+    cpu->active_as = as;
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+// --- Kernel virtual regions (VMAs) ---
+// Areas of the vmalloc window, each fully backed when it is allocated.
+// Nothing is demand-paged: a fault taken with a spinlock held could neither
+// allocate a frame nor wait for a TLB shootdown.
+static vm_area_t* vma_list = NULL;     // Sorted by start address
+static spinlock_t vma_lock;
+
+// Reserves size bytes inside [window_start, window_end) with an unmapped
+// guard page on each side.
+static void* vma_reserve_in(uintptr_t window_start, uintptr_t window_end, size_t size,
+                            const char* name) {
+    size = align_up(size, PAGE_SIZE);
+    if (size == 0) return NULL;
+    vm_area_t* area = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+    if (!area) return NULL;
+
+    unsigned long irq = spinlock_acquire_irqsave(&vma_lock);
+    // First fit over the gaps between existing areas
+    uintptr_t start = window_start + PAGE_SIZE;
+    vm_area_t** link = &vma_list;
+    while (*link) {
+        vm_area_t* v = *link;
+        if (v->end + PAGE_SIZE <= start) {
+            link = &v->next;   // Entirely below the candidate
+            continue;
+        }
+        if (v->start >= start + size + PAGE_SIZE) break;
+        start = v->end + PAGE_SIZE;
+        link = &v->next;
+    }
+    if (start + size + PAGE_SIZE > window_end) {
+        spinlock_release_irqrestore(&vma_lock, irq);
+        kfree(area);
+        return NULL;
+    }
+    area->start = start;
+    area->end = start + size;
+    area->name = name;
+    area->next = *link;
+    *link = area;
+    spinlock_release_irqrestore(&vma_lock, irq);
+    return (void*)start;
+}
+
+// Virtually contiguous allocation backed by individual order-0 frames, so it
+// never needs a high-order buddy block. Guard pages separate allocations.
+// Movable frames may be migrated by compaction while the other CPUs are
+// parked, which is only safe for memory no parked CPU is still using.
+static void* vmalloc_named(size_t size, const char* name, bool movable) {
+    uint8_t* base = (uint8_t*)vma_reserve_in(VMALLOC_START, VMALLOC_END, size, name);
+    if (!base) return NULL;
+    size = align_up(size, PAGE_SIZE);
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        void* frame = pmm_alloc_page();
+        if (!frame) {
+            vma_release(base); // Frees the frames mapped so far
+            return NULL;
+        }
+        paging_map((uint64_t)frame, (uint64_t)(base + off), PTE_PRESENT | PTE_RW);
+        if (movable) pmm_mark_movable(frame, (uintptr_t)(base + off));
+    }
+    return base;
+}
+
+void* vmalloc(size_t size) {
+    return vmalloc_named(size, "vmalloc", true);
+}
+
+// Kernel stacks are fully backed up front: a stack-growth fault taken while
+// the allocator's locks are held could never resolve. They are not movable
+// either: a CPU parked during compaction keeps running on its stack.
+void* vmalloc_stack(size_t size) {
+    return vmalloc_named(size, "stack", false);
+}
+
+void vfree(void* addr) {
+    if (addr) vma_release(addr);
+}
+
+// Unmaps an area and frees its frames.
+void vma_release(void* addr) {
+    unsigned long irq = spinlock_acquire_irqsave(&vma_lock);
+    vm_area_t** link = &vma_list;
+    while (*link && (*link)->start != (uintptr_t)addr) link = &(*link)->next;
+    vm_area_t* area = *link;
+    if (!area) {
+        spinlock_release_irqrestore(&vma_lock, irq);
+        return;
+    }
+    *link = area->next;
+    spinlock_release_irqrestore(&vma_lock, irq);
+
+    // Interrupts off so compaction cannot move a frame between reading
+    // its PTE and freeing it
+    irq = local_irq_save();
+    for (uintptr_t va = area->start; va < area->end; va += PAGE_SIZE) {
+        uint64_t* pte = paging_get_pte(va);
+        if (!pte || !(*pte & PTE_PRESENT)) continue;
+        pmm_free_page((void*)(*pte & PTE_ADDR_MASK));
+    }
+    paging_unmap_range(area->start, area->end - area->start);
+    local_irq_restore(irq);
+    kfree(area);
+}
+
+registers_t* page_fault_handler(registers_t *r) {
+    uint64_t faulting_address;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r" (faulting_address));
+
+    console_write("\n[CRITICAL] PAGE FAULT at 0x");
+    console_write_hex(faulting_address);
+    console_write(" (err ");
+    console_write_dec((uint32_t)r->err_code);
+    console_write(")\nSystem Halted.\n");
+    __asm__ __volatile__("cli");
+    for(;;) { __asm__ __volatile__("hlt"); }
+    return r;
+}
+
+// True if [phys, phys + size) lies entirely inside the direct map: the low
+// 2 MB (minus page 0) or e820 RAM/ACPI ranges, which may be adjacent.
+bool direct_mapped(uint64_t phys, uint64_t size) {
+    uint64_t end = phys + size;
+    if (phys < PAGE_SIZE || end < phys) return false;
+    bool advanced = true;
+    while (phys < end && advanced) {
+        advanced = false;
+        if (phys < PAGE_SIZE_2M) {
+            phys = PAGE_SIZE_2M;
+            advanced = true;
+        }
+        for (int i = 0; i < direct_map_count; i++) {
+            if (direct_map[i].start <= phys && phys < direct_map[i].end) {
+                phys = direct_map[i].end;
+                advanced = true;
+            }
+        }
+    }
+    return phys >= end;
+}
+
+void paging_install(void) {
+    kernel_pml4 = (pt_t*)alloc_zeroed_page();
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        cpu_has_1g_pages = (edx >> 26) & 1; // pdpe1gb
+    }
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    cpu_has_pge = (edx >> 13) & 1;
+    cpu_has_pcid = (ecx >> 17) & 1;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        cpu_has_invpcid = cpu_has_pcid && ((ebx >> 10) & 1);
+    }
+    // Set before any mapping exists so every kernel PTE is global
+    if (cpu_has_pge) pte_global = PTE_GLOBAL;
+
+    // First 2 MB at 4 KB granularity: page 0 stays unmapped to catch NULL
+    // dereferences, and the legacy VGA/BIOS hole is mapped uncached.
+    paging_map_range(PAGE_SIZE, PAGE_SIZE, 0xA0000 - PAGE_SIZE, PTE_PRESENT | PTE_RW);
+    paging_map_range(0xA0000, 0xA0000, 0x60000, PTE_PRESENT | PTE_RW | PTE_PCD | PTE_PWT);
+    paging_map_range(0x100000, 0x100000, PAGE_SIZE_2M - 0x100000, PTE_PRESENT | PTE_RW);
+
+    // Direct map of the RAM and ACPI ranges only, using huge pages where a
+    // range covers them whole. Holes (LAPIC, IOAPIC, PCI windows) stay
+    // unmapped so they are never cached write-back; drivers map them UC.
+    for (int i = 0; i < direct_map_count; i++) {
+        uint64_t start = direct_map[i].start, end = direct_map[i].end;
+        if (start < PAGE_SIZE_2M) start = PAGE_SIZE_2M;
+        if (end > start) paging_map_range(start, start, end - start, PTE_PRESENT | PTE_RW);
+    }
+
+    // Map Framebuffer uncached, splitting any huge page it shares
+    uint64_t fb_phys = screen_info.physbase;
+    // Calculate actual framebuffer size based on resolution and pitch
+    uint64_t fb_size = (uint64_t)screen_info.pitch * screen_info.resolution_y;
+    if (fb_phys != 0) {
+        paging_map_range(fb_phys & ~(uint64_t)(PAGE_SIZE - 1), fb_phys & ~(uint64_t)(PAGE_SIZE - 1),
+                         fb_size + (fb_phys & (PAGE_SIZE - 1)), PTE_PRESENT | PTE_RW | PTE_PCD | PTE_PWT);
+    }
+    // Populate the shared upper-half slots now: address spaces copy the
+    // PML4 entries once, so they must never change afterwards.
+    for (uint64_t va = VMALLOC_START; va < VMALLOC_END; va += 1ULL << 39) {
+        paging_next_level(&kernel_pml4->entries[(va >> 39) & 0x1FF], PAGE_SIZE_1G);
+    }
+    spinlock_init(&vma_lock);
+    spinlock_init(&pcid_lock);
+    register_interrupt_handler(14, page_fault_handler);
+
+    kernel_address_space.pml4 = kernel_pml4->entries;
+    kernel_address_space.pcid = 0;
+    kernel_address_space.refcount = 1;
+    pcid_bitmap[0] = 1;     // PCID 0 is the kernel's
+    __asm__ __volatile__("mov %0, %%cr3" :: "r"(kernel_pml4));
+    paging_init_cpu();
+}
+
+// Per-CPU half of paging_install; APs arrive with the kernel PML4 loaded.
+void paging_init_cpu(void) {
+    this_cpu()->active_as = &kernel_address_space;
+
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    if (cpu_has_pge) cr4 |= CR4_PGE;
+    if (cpu_has_pcid) cr4 |= CR4_PCIDE;   // CR3[11:0] is 0 here, as required
+    __asm__ __volatile__("mov %0, %%cr4" :: "r"(cr4));
+
+    // CR0.WP: make read-only PTEs binding for ring 0 too
+    uint64_t cr0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__("mov %0, %%cr0" :: "r"(cr0 | (1ULL << 16)));
+}
+
+// ==========================================
+// FILE: timer.c
+// ==========================================
+volatile uint32_t ticks = 0;
+
+// --- Hierarchical timer wheel ---
+// Five levels cover the full 32-bit tick range: 256 one-tick slots, then
+// four levels of 64 slots, each slot 64x coarser than the one below. Timers
+// sit in the slot for their expiry and are re-filed one level down when
+// the lower level wraps, so insert and cancel are O(1) and a tick only
+// touches the timers that actually expire.
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+
+static ktimer_t* tv1[TVR_SIZE];
+static ktimer_t* tvn[4][TVN_SIZE];
+static uint32_t timer_jiffies = 0;   // Next tick the wheel will process
+static spinlock_t timer_lock;
+
+static void timer_link(ktimer_t** slot, ktimer_t* t) {
+    t->next = *slot;
+    if (*slot) (*slot)->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+}
+
+static void timer_unlink(ktimer_t* t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void timer_enqueue(ktimer_t* t) {
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - timer_jiffies;
+    ktimer_t** slot;
+    if ((int32_t)delta < 0) {
+        slot = &tv1[timer_jiffies & TVR_MASK];   // Already due: next tick
+    } else if (delta < TVR_SIZE) {
+        slot = &tv1[expires & TVR_MASK];
+    } else {
+        int level = 0;
+        while (level < 3 && delta >= 1u << (TVR_BITS + (level + 1) * TVN_BITS)) level++;
+        slot = &tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+    timer_link(slot, t);
+}
+
+// Re-files every timer in one coarse slot into the levels below it.
+static uint32_t timer_cascade(int level, uint32_t index) {
+    ktimer_t* t = tvn[level][index];
+    tvn[level][index] = NULL;
+    while (t) {
+        ktimer_t* next = t->next;
+        timer_enqueue(t);
+        t = next;
+    }
+    return index;
+}
+
+static void tick_nohz_kick(void);
+
+#define TIMER_INDEX(n) ((timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+static void timer_run(void) {
+    unsigned long irq = spinlock_acquire_irqsave(&timer_lock);
+    while ((int32_t)(ticks - timer_jiffies) >= 0) {
+        uint32_t index = timer_jiffies & TVR_MASK;
+        if (!index && !timer_cascade(0, TIMER_INDEX(0)) && !timer_cascade(1, TIMER_INDEX(1)) &&
+            !timer_cascade(2, TIMER_INDEX(2))) {
+            timer_cascade(3, TIMER_INDEX(3));
+        }
+        timer_jiffies++;
+        // Take the slot's timers as a batch: anything armed from now on,
+        // even for this slot a full wheel turn later, waits for its turn
+        ktimer_t* expired = tv1[index];
+        tv1[index] = NULL;
+        if (expired) expired->pprev = &expired;   // timer_cancel still works
+        while (expired) {
+            ktimer_t* t = expired;
+            timer_unlink(t);
+            // Callbacks may re-arm their timer, so drop the lock around them
+            spinlock_release(&timer_lock);
+            t->callback(t->data);
+            spinlock_acquire(&timer_lock);
+        }
+    }
+    spinlock_release_irqrestore(&timer_lock, irq);
+}
+
+void timer_setup(ktimer_t* t, void (*callback)(void*), void* data) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->callback = callback;
+    t->data = data;
+}
+
+// Arms (or re-arms) t to run its callback from the timer interrupt once
+// get_ticks() reaches deadline.
+void timer_add(ktimer_t* t, uint32_t deadline) {
+    unsigned long irq = spinlock_acquire_irqsave(&timer_lock);
+    if (t->pprev) timer_unlink(t);
+    t->expires = deadline;
+    timer_enqueue(t);
+    spinlock_release_irqrestore(&timer_lock, irq);
+    tick_nohz_kick();
+}
+
+// Returns true if the timer was pending.
+bool timer_cancel(ktimer_t* t) {
+    unsigned long irq = spinlock_acquire_irqsave(&timer_lock);
+    bool pending = t->pprev != NULL;
+    if (pending) timer_unlink(t);
+    spinlock_release_irqrestore(&timer_lock, irq);
+    return pending;
+}
+
+// Tickless idle statistics, see tick_stats_print
+static uint32_t timer_irqs = 0;
+static uint32_t nohz_entries = 0;
+static uint32_t nohz_ticks_skipped = 0;
+
+static void clock_tick(void);
+
+registers_t* timer_handler(registers_t *r) {
+    ticks++;
+    timer_irqs++;
+    clock_tick();
+    timer_run();
+    scheduler_tick();   // irq_handler switches on the way out if the slice is used up
+    return r;
+}
+uint32_t get_ticks() {
+    return ticks;
+}
+
+// --- PIT programming ---
+#define PIT_FREQUENCY 1193180
+#define TIMER_HZ 100
+#define PIT_TICK_COUNT (PIT_FREQUENCY / TIMER_HZ)
+#define PIT_ONESHOT_MAX_TICKS (0xFFFF / PIT_TICK_COUNT)   // 16-bit counter: 5 ticks
+
+static void pit_set_periodic(void) {
+    outb(0x43, 0x34);   // Channel 0, lo/hi, mode 2: the count falls linearly
+    outb(0x40, (uint8_t)(PIT_TICK_COUNT & 0xFF));
+    outb(0x40, (uint8_t)((PIT_TICK_COUNT >> 8) & 0xFF));
+}
+
+static void pit_set_oneshot(uint16_t count) {
+    outb(0x43, 0x30);   // Channel 0, lo/hi, mode 0: one IRQ at terminal count
+    outb(0x40, (uint8_t)(count & 0xFF));
+    outb(0x40, (uint8_t)(count >> 8));
+}
+
+static uint16_t pit_read_count(void) {
+    outb(0x43, 0x00);   // Latch channel 0
+    uint8_t l = inb(0x40);
+    uint8_t h = inb(0x40);
+    return (uint16_t)(l | (h << 8));
+}
+
+// An int $0x20 yield arrives on the timer vector too; only the PIC knows
+// whether IRQ0 really fired.
+static bool pit_irq_in_service(void) {
+    outb(0x20, 0x0B);   // OCW3: read ISR
+    return inb(0x20) & 0x01;
+}
+
+// --- Tick device ---
+// The LAPIC timer once smp_init has calibrated it (CPU 0 then masks IRQ0),
+// otherwise the PIT. Counts are in the device's own units.
+static bool tick_lapic = false;
+static uint32_t lapic_timer_period(void);
+static uint32_t lapic_timer_remaining(void);
+static void lapic_timer_start(void);
+static void lapic_timer_oneshot(uint32_t count);
+static void lapic_timer_stop(void);
+
+static uint32_t tick_period(void) {
+    return tick_lapic ? lapic_timer_period() : PIT_TICK_COUNT;
+}
+
+static uint32_t tick_read_count(void) {
+    return tick_lapic ? lapic_timer_remaining() : pit_read_count();
+}
+
+static void tick_set_periodic(void) {
+    if (tick_lapic) lapic_timer_start();
+    else pit_set_periodic();
+}
+
+static void tick_set_oneshot(uint32_t count) {
+    if (tick_lapic) lapic_timer_oneshot(count);
+    else pit_set_oneshot((uint16_t)count);
+}
+
+// True if r is the stopped tick's one-shot firing. A LAPIC one-shot stays
+// at zero once expired, so a stale periodic interrupt is not mistaken for it.
+static bool tick_oneshot_fired(registers_t* r) {
+    if (tick_lapic) return r->int_no == LAPIC_TIMER_VECTOR && lapic_timer_remaining() == 0;
+    return r->int_no == 32 && pit_irq_in_service();
+}
+
+// --- Tickless idle ---
+// When CPU 0's idle task is about to halt, the periodic tick is replaced by
+// a one-shot interrupt at the next wheel expiry. The 32-bit LAPIC counter
+// covers NOHZ_MAX_TICKS; the 16-bit PIT only PIT_ONESHOT_MAX_TICKS. The
+// first interrupt out of halt credits the ticks that passed. If that is not
+// the one-shot itself, the remainder of the current tick is re-armed so
+// that periodic mode restarts on the original tick boundary.
+// APs keep no tick count and run no wheel, so an idle AP just stops its
+// LAPIC timer until the next interrupt; busy CPUs kick it to steal work.
+#define NOHZ_MAX_TICKS 1000   // Bounds the wheel scan below
+bool nohz_enabled = true;
+static uint32_t tick_stop_count;    // Device counts programmed for CPU 0's one-shot
+
+// Ticks from timer_jiffies until the next jiffy that needs processing, up to
+// limit. A tv1 wrap only matters if the slots it cascades hold timers: idle
+// catch-up runs every skipped jiffy through timer_run, cascades included.
+static uint32_t timer_next_event(uint32_t limit) {
+    for (uint32_t n = 0; n < limit; n++) {
+        uint32_t jiffy = timer_jiffies + n;
+        if (tv1[jiffy & TVR_MASK]) return n;
+        if ((jiffy & TVR_MASK) || n == 0) continue;
+        for (int level = 0; level < 4; level++) {
+            uint32_t index = (jiffy >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+            if (tvn[level][index]) return n;
+            if (index) break;   // Higher levels only cascade when this one wraps
+        }
+    }
+    return limit;
+}
+
+// Called by the idle task with interrupts disabled, right before sti; hlt.
+void tick_nohz_idle_enter(void) {
+    cpu_t* cpu = this_cpu();
+    if (!nohz_enabled || cpu->tick_stopped) return;
+    if (cpu->id != 0) {
+        if (!tick_lapic) return;
+        lapic_timer_stop();
+        cpu->tick_stopped = true;
+        __atomic_add_fetch(&nohz_entries, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint32_t period = tick_period();
+    uint32_t max_ticks = tick_lapic ? 0xFFFFFFFFu / period : PIT_ONESHOT_MAX_TICKS;
+    if (max_ticks > NOHZ_MAX_TICKS) max_ticks = NOHZ_MAX_TICKS;
+    spinlock_acquire(&timer_lock);
+    uint32_t pending = ticks - timer_jiffies + 1;   // Non-zero only if the wheel lags
+    uint32_t idle_ticks = pending ? 0 : timer_next_event(max_ticks - 1) + 1;
+    spinlock_release(&timer_lock);
+    if (idle_ticks < 2) return;
+
+    // Keep the phase: finish the current tick, then whole ticks
+    uint32_t now = tick_read_count();
+    if (now == 0 || now > period) now = period;
+    tick_stop_count = now + (idle_ticks - 1) * period;
+    cpu->tick_stopped = true;
+    __atomic_add_fetch(&nohz_entries, 1, __ATOMIC_RELAXED);
+    tick_set_oneshot(tick_stop_count);
+}
+
+// The wheel only runs on CPU 0. A timer armed elsewhere may be due before
+// the one-shot CPU 0 programmed, so wake it to re-evaluate.
+static void tick_nohz_kick(void) {
+    if (cpus[0].tick_stopped && smp_processor_id() != 0) smp_send_reschedule(0);
+}
+
+// From a busy CPU's tick: an idle CPU with its tick stopped no longer looks
+// for work to steal, so wake one while this CPU has tasks waiting.
+static void tick_nohz_kick_idle(uint32_t queued) {
+    if (!queued || nr_cpus_online < 2) return;
+    uint32_t self = smp_processor_id();
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        if (i != self && cpus[i].tick_stopped) {
+            smp_send_reschedule(i);
+            return;
+        }
+    }
+}
+
+// Called on entry to every interrupt; cheap unless the tick is stopped.
+void tick_nohz_irq_enter(registers_t* r) {
+    cpu_t* cpu = this_cpu();
+    if (!cpu->tick_stopped) return;
+    if (cpu->id != 0) {
+        cpu->tick_stopped = false;
+        lapic_timer_start();
+        return;
+    }
+
+    uint32_t period = tick_period();
+    if (tick_oneshot_fired(r)) {
+        // One-shot expired: timer_handler accounts the final tick
+        uint32_t skipped = (tick_stop_count - 1) / period;
+        ticks += skipped;
+        nohz_ticks_skipped += skipped;
+        tick_set_periodic();
+        cpu->tick_stopped = false;
+        return;
+    }
+
+    // Tick boundaries fall wherever the remaining count is a multiple of
+    // period, the last one at terminal count
+    uint32_t remaining = tick_read_count();
+    uint32_t total = (tick_stop_count + period - 1) / period;
+    uint32_t elapsed;
+    if (remaining == 0 || remaining > tick_stop_count) {
+        // Wrapped: the one-shot IRQ is pending and accounts the last tick
+        elapsed = total - 1;
+        tick_stop_count = 1;
+    } else {
+        uint32_t left = (remaining + period - 1) / period;
+        elapsed = total - left;
+        tick_stop_count = remaining - (left - 1) * period;
+        tick_set_oneshot(tick_stop_count);
+    }
+    ticks += elapsed;
+    nohz_ticks_skipped += elapsed;
+    // Process the credited ticks now instead of at the next interrupt
+    if (elapsed) timer_run();
+}
+
+void tick_stats_print(void) {
+    vga_print_string("\nticks ");
+    vga_print_dec(ticks);
+    vga_print_string("  timer irqs ");
+    vga_print_dec(timer_irqs);
+    vga_print_string("\nnohz ");
+    vga_print_string(nohz_enabled ? "on" : "off");
+    vga_print_string(tick_lapic ? " (lapic)" : " (pit)");
+    vga_print_string("  idle entries ");
+    vga_print_dec(nohz_entries);
+    vga_print_string("  ticks skipped ");
+    vga_print_dec(nohz_ticks_skipped);
+    vga_print_string("\n");
+}
+
+void timer_install() {
+    spinlock_init(&timer_lock);
+    pit_set_periodic();
+    irq_install_handler(0, timer_handler); 
+}
+
+// ==========================================
+// FILE: clock.c
+// ==========================================
+// ns = base_ns + ((tsc - base_tsc) * mult >> shift). The timer tick rebases
+// under the seqlock so the delta (and the product) stays small.
+#define CLOCK_SHIFT 24
+
+uint32_t tsc_khz = 0;
+bool tsc_invariant = false;
+
+static seqlock_t clock_seq;
+static uint64_t clock_base_tsc = 0;
+static uint64_t clock_base_ns = 0;
+static uint32_t clock_mult = 0;
+static uint64_t wall_base_ns = 0;     // Unix time at monotonic time 0
+
+// Counts TSC cycles across one PIT channel 2 mode 0 countdown.
+static uint64_t tsc_measure_pit(uint16_t pit_counts) {
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x03));          // Gate low, speaker off
+    outb(0x43, 0xB0);                    // Channel 2, lo/hi, mode 0
+    outb(0x42, (uint8_t)(pit_counts & 0xFF));
+    outb(0x42, (uint8_t)(pit_counts >> 8));
+    outb(0x61, (gate & ~0x02) | 0x01);   // Gate high: start counting
+    uint64_t t0 = rdtsc();
+    while (!(inb(0x61) & 0x20)) { }      // OUT2 goes high at terminal count
+    uint64_t t1 = rdtsc();
+    outb(0x61, gate);
+    return t1 - t0;
+}
+
+static void tsc_calibrate(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = (edx >> 8) & 1;
+    }
+
+    // Best of three 20 ms windows; SMIs and emulation only make a window longer
+    uint16_t counts = PIT_FREQUENCY / 50;
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < 3; i++) {
+        uint64_t cycles = tsc_measure_pit(counts);
+        if (cycles < best) best = cycles;
+    }
+    tsc_khz = (uint32_t)(best * PIT_FREQUENCY / counts / 1000);
+    if (tsc_khz == 0) tsc_khz = 1;
+    // mult = ns per cycle << CLOCK_SHIFT
+    clock_mult = (uint32_t)((1000000ULL << CLOCK_SHIFT) / tsc_khz);
+}
+
+static inline uint64_t clock_read_locked(uint64_t tsc) {
+    return clock_base_ns + (((tsc - clock_base_tsc) * clock_mult) >> CLOCK_SHIFT);
+}
+
+// Timer interrupt: fold the elapsed cycles into the base.
+static void clock_tick(void) {
+    if (!clock_mult) return;
+    write_seqlock(&clock_seq);
+    uint64_t tsc = rdtsc();
+    clock_base_ns = clock_read_locked(tsc);
+    clock_base_tsc = tsc;
+    write_sequnlock(&clock_seq);
+}
+
+uint64_t ktime_get_ns(void) {
+    if (!clock_mult) return (uint64_t)ticks * NSEC_PER_TICK;
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = read_seqbegin(&clock_seq);
+        ns = clock_read_locked(rdtsc());
+    } while (read_seqretry(&clock_seq, seq));
+    return ns;
+}
+
+uint64_t ktime_get_real_ns(void) {
+    return wall_base_ns + ktime_get_ns();
+}
+
+void ndelay(uint64_t ns) {
+    uint64_t deadline = ktime_get_ns() + ns;
+    while (ktime_get_ns() < deadline) { __asm__ volatile ("pause"); }
+}
+
+// Whole ticks go to the timer wheel; the sub-tick remainder is spun off
+// against the TSC so short sleeps are precise.
+void nsleep(uint64_t ns) {
+    uint64_t deadline = ktime_get_ns() + ns;
+    // A wheel sleep ends on a tick boundary, up to a tick early of n*10ms
+    uint64_t whole = ns / NSEC_PER_TICK;
+    if (whole >= 2) sleep((uint32_t)((whole - 1) * 10));
+    while (ktime_get_ns() < deadline) { __asm__ volatile ("pause"); }
+}
+
+void usleep(uint64_t us) {
+    nsleep(us * 1000);
+}
+
+// --- CMOS RTC ---
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA    0x71
+
+typedef struct {
+    uint8_t second, minute, hour, day, month;
+    uint16_t year;
+} rtc_time_t;
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_ADDRESS, 0x80 | reg);   // Keep NMI disabled while selecting
+    uint8_t value = inb(CMOS_DATA);
+    // Bit 7 of the index port is the NMI mask and the port is write-only,
+    // so re-enable NMI explicitly rather than leave it masked
+    outb(CMOS_ADDRESS, reg);
+    return value;
+}
+
+static void rtc_read_raw(rtc_time_t* t, uint8_t* century) {
+    while (cmos_read(0x0A) & 0x80) { }   // Update in progress
+    t->second = cmos_read(0x00);
+    t->minute = cmos_read(0x02);
+    t->hour = cmos_read(0x04);
+    t->day = cmos_read(0x07);
+    t->month = cmos_read(0x08);
+    t->year = cmos_read(0x09);
+    *century = cmos_read(0x32);
+}
+
+static uint8_t bcd_to_bin(uint8_t v) {
+    return (uint8_t)((v & 0x0F) + (v >> 4) * 10);
+}
+
+// Reads until two consecutive samples agree, so an update cannot tear the result.
+static void rtc_read(rtc_time_t* t) {
+    rtc_time_t last;
+    uint8_t century, last_century;
+    rtc_read_raw(t, &century);
+    do {
+        last = *t;
+        last_century = century;
+        rtc_read_raw(t, &century);
+    } while (last.second != t->second || last.minute != t->minute || last.hour != t->hour ||
+             last.day != t->day || last.month != t->month || last.year != t->year ||
+             last_century != century);
+
+    uint8_t status_b = cmos_read(0x0B);
+    bool pm = t->hour & 0x80;
+    t->hour &= 0x7F;
+    if (!(status_b & 0x04)) {
+        t->second = bcd_to_bin(t->second);
+        t->minute = bcd_to_bin(t->minute);
+        t->hour = bcd_to_bin(t->hour);
+        t->day = bcd_to_bin(t->day);
+        t->month = bcd_to_bin(t->month);
+        t->year = bcd_to_bin((uint8_t)t->year);
+        century = bcd_to_bin(century);
+    }
+    if (!(status_b & 0x02)) {
+        // 12-hour mode: 12 AM is 0, PM adds 12
+        if (t->hour == 12) t->hour = 0;
+        if (pm) t->hour += 12;
+    }
+    t->year += (century >= 19 && century <= 30) ? century * 100 : 2000;
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian date.
+static uint64_t days_from_civil(uint32_t y, uint32_t m, uint32_t d) {
+    y -= m <= 2;
+    uint32_t era = y / 400;
+    uint32_t yoe = y - era * 400;
+    uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (uint64_t)era * 146097 + doe - 719468;
+}
+
+void rtc_init(void) {
+    rtc_time_t t;
+    rtc_read(&t);
+    uint64_t secs = days_from_civil(t.year, t.month, t.day) * 86400ULL +
+                    t.hour * 3600ULL + t.minute * 60ULL + t.second;
+    wall_base_ns = secs * NSEC_PER_SEC - ktime_get_ns();
+}
+
+// Wall-clock time of day, from the clock synced at boot.
+void rtc_get_time(uint8_t* hour, uint8_t* minute, uint8_t* second) {
+    uint64_t day_secs = (ktime_get_real_ns() / NSEC_PER_SEC) % 86400;
+    *hour = (uint8_t)(day_secs / 3600);
+    *minute = (uint8_t)((day_secs / 60) % 60);
+    *second = (uint8_t)(day_secs % 60);
+}
+
+void clock_init(void) {
+    vga_print_string("Calibrating TSC... ");
+    seqlock_init(&clock_seq);
+    uint64_t boot_ns = (uint64_t)ticks * NSEC_PER_TICK;
+    tsc_calibrate();
+    // Continue from the tick-based time so the clock never steps backwards
+    clock_base_tsc = rdtsc();
+    clock_base_ns = boot_ns;
+    vga_print_dec(tsc_khz / 1000);
+    vga_print_string(" MHz");
+    if (!tsc_invariant) vga_print_string(" (not invariant)");
+    vga_print_string(" [OK]\n");
+    rtc_init();
+}
+
+// ==========================================
+// FILE: smp.c
+// ==========================================
+// CPUs are found through the ACPI MADT and started with INIT-SIPI-SIPI on
+// the real-mode trampoline in kernel_entry.asm. The PIC keeps delivering
+// device IRQs to CPU 0; every other CPU is driven by its local APIC timer
+// and by IPIs.
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;            // Revision 2+
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed));
+
+#define MADT_LOCAL_APIC          0
+#define MADT_LAPIC_OVERRIDE      5
+#define MADT_LAPIC_ENABLED       0x1
+
+static bool acpi_checksum(const void* table, size_t len) {
+    const uint8_t* p = (const uint8_t*)table;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++) sum += p[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary in the EBDA or the BIOS ROM area.
+// Page 0 is unmapped, so the EBDA pointer is not read; its usual range is scanned.
+static struct acpi_rsdp* acpi_find_rsdp(void) {
+    static const uintptr_t ranges[2][2] = { { 0x80000, 0xA0000 }, { 0xE0000, 0x100000 } };
+    for (int r = 0; r < 2; r++) {
+        for (uintptr_t a = ranges[r][0]; a < ranges[r][1]; a += 16) {
+            struct acpi_rsdp* rsdp = (struct acpi_rsdp*)a;
+            if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum(rsdp, 20)) return rsdp;
+        }
+    }
+    return NULL;
+}
+
+static struct acpi_sdt_header* acpi_table_at(uint64_t phys) {
+    // Tables must lie in RAM or ACPI ranges, which the direct map covers
+    if (phys == 0 || !direct_mapped(phys, sizeof(struct acpi_sdt_header))) return NULL;
+    struct acpi_sdt_header* h = (struct acpi_sdt_header*)phys;
+    if (!direct_mapped(phys, h->length) || !acpi_checksum(h, h->length)) return NULL;
+    return h;
+}
+
+static struct acpi_sdt_header* acpi_find_table(const char* signature) {
+    struct acpi_rsdp* rsdp = acpi_find_rsdp();
+    if (!rsdp) return NULL;
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address;
+    struct acpi_sdt_header* root = acpi_table_at(xsdt ? rsdp->xsdt_address : rsdp->rsdt_address);
+    if (!root) return NULL;
+    uint32_t entry_size = xsdt ? 8 : 4;
+    uint32_t count = (root->length - sizeof(*root)) / entry_size;
+    uint8_t* entries = (uint8_t*)(root + 1);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t phys = xsdt ? *(uint64_t*)(entries + i * 8) : *(uint32_t*)(entries + i * 4);
+        struct acpi_sdt_header* h = acpi_table_at(phys);
+        if (h && memcmp(h->signature, signature, 4) == 0) return h;
+    }
+    return NULL;
+}
+
+// --- Local APIC ---
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define ICR_INIT            0x00000500
+#define ICR_STARTUP         0x00000600
+#define ICR_ASSERT          0x00004000
+#define ICR_PENDING         0x00001000
+#define LVT_MASKED          0x00010000
+#define LVT_TIMER_PERIODIC  0x00020000
+
+static volatile uint32_t* lapic = NULL;
+static uint32_t lapic_timer_count = 0;   // Initial count for one scheduler tick
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_enable(void) {
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | (1 << 11));
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, 0x100 | SPURIOUS_VECTOR);
+}
+
+// Measures the APIC timer against the TSC clock; the bus clock is shared by all CPUs.
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);   // Divide by 16
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    ndelay(NSEC_PER_TICK);
+    lapic_timer_count = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+static void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+// One-shot mode counts down once and stays at zero; used by nohz idle.
+static void lapic_timer_oneshot(uint32_t count) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+static void lapic_timer_stop(void) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+static uint32_t lapic_timer_remaining(void) {
+    return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+static uint32_t lapic_timer_period(void) {
+    return lapic_timer_count;
+}
+
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    // The two ICR writes must not be split by an IPI sent from an interrupt
+    unsigned long irq = local_irq_save();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) { __asm__ volatile ("pause"); }
+    local_irq_restore(irq);
+}
+
+// --- IPIs ---
+static volatile bool smp_stopping = false;
+static volatile int32_t smp_stopper = -1;
+static volatile uint32_t smp_parked = 0;
+static spinlock_t smp_stop_lock;
+
+void smp_send_reschedule(uint32_t cpu) {
+    if (!lapic || cpu >= nr_cpus_online) return;
+    lapic_send(cpus[cpu].apic_id, ICR_ASSERT | RESCHED_VECTOR);
+}
+
+// Spins with interrupts off until compaction (or whoever stopped the
+// machine) lets go; pages may have moved, so the TLB is flushed.
+static void smp_park(void) {
+    __atomic_add_fetch(&smp_parked, 1, __ATOMIC_ACQ_REL);
+    while (smp_stopping) {
+        cpu_t* cpu = this_cpu();
+        if (cpu->tlb_flush_pending) {
+            cpu->tlb_flush_pending = false;
+            tlb_flush_local();
+        }
+        __asm__ volatile ("pause");
+    }
+    tlb_flush_local();
+    __atomic_sub_fetch(&smp_parked, 1, __ATOMIC_ACQ_REL);
+}
+
+// Serves requests aimed at this CPU while it waits on others with
+// interrupts off, so two CPUs waiting on each other both make progress.
+static void smp_poll_requests(void) {
+    cpu_t* cpu = this_cpu();
+    if (cpu->tlb_flush_pending) {
+        cpu->tlb_flush_pending = false;
+        tlb_flush_local();
+    }
+    if (smp_stopping && smp_stopper != (int32_t)cpu->id) smp_park();
+}
+
+// Flushes every other CPU's TLB and waits until they have done it.
+void smp_tlb_shootdown(void) {
+    if (nr_cpus_online < 2) return;
+    unsigned long irq = local_irq_save();
+    uint32_t self = smp_processor_id();
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        if (i == self) continue;
+        cpus[i].tlb_flush_pending = true;
+        lapic_send(cpus[i].apic_id, ICR_ASSERT | TLB_FLUSH_VECTOR);
+    }
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        while (i != self && cpus[i].tlb_flush_pending) {
+            smp_poll_requests();
+            __asm__ volatile ("pause");
+        }
+    }
+    local_irq_restore(irq);
+}
+
+// Parks every other CPU with interrupts off. Call with interrupts disabled.
+void smp_stop_others(void) {
+    if (nr_cpus_online < 2) return;
+    uint32_t self = smp_processor_id();
+    while (!spinlock_trylock(&smp_stop_lock)) {
+        smp_poll_requests();
+        __asm__ volatile ("pause");
+    }
+    smp_stopper = (int32_t)self;
+    smp_stopping = true;
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        if (i != self) lapic_send(cpus[i].apic_id, ICR_ASSERT | STOP_VECTOR);
+    }
+    while (smp_parked < nr_cpus_online - 1) {
+        smp_poll_requests();
+        __asm__ volatile ("pause");
+    }
+}
+
+void smp_resume_others(void) {
+    if (nr_cpus_online < 2) return;
+    smp_stopping = false;
+    while (smp_parked) { __asm__ volatile ("pause"); }
+    smp_stopper = -1;
+    spinlock_release(&smp_stop_lock);
+}
 
-void paging_map(uint64_t phys, uint64_t virt, uint64_t flags) {
-    if (!kernel_pml4) return;
+// CPU 0 keeps time and runs the timer wheel; the others only schedule.
+static registers_t* lapic_timer_handler(registers_t* r) {
+    lapic_eoi();
+    if (smp_processor_id() == 0) timer_handler(r);
+    else scheduler_tick();
+    schedule_irq_exit();
+    return r;
+}
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx   = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx   = (virt >> 12) & 0x1FF;
+static registers_t* resched_handler(registers_t* r) {
+    lapic_eoi();
+    this_cpu()->nr_ipis++;
+    schedule();
+    return r;
+}
 
-    if (!(kernel_pml4->entries[pml4_idx] & PTE_PRESENT)) {
-        pt_t* new_pdpt = (pt_t*)pmm_alloc_page();
-        memset(new_pdpt, 0, PAGE_SIZE);
-        kernel_pml4->entries[pml4_idx] = (uint64_t)new_pdpt | PTE_PRESENT | PTE_RW | PTE_USER;
+static registers_t* tlb_flush_handler(registers_t* r) {
+    cpu_t* cpu = this_cpu();
+    cpu->nr_ipis++;
+    if (cpu->tlb_flush_pending) {
+        tlb_flush_local();
+        cpu->tlb_flush_pending = false;
     }
-    pt_t* pdpt = (pt_t*)(kernel_pml4->entries[pml4_idx] & ~0xFFF);
+    lapic_eoi();
+    return r;
+}
 
-    if (!(pdpt->entries[pdpt_idx] & PTE_PRESENT)) {
-        pt_t* new_pd = (pt_t*)pmm_alloc_page();
-        memset(new_pd, 0, PAGE_SIZE);
-        pdpt->entries[pdpt_idx] = (uint64_t)new_pd | PTE_PRESENT | PTE_RW | PTE_USER;
-    }
-    pt_t* pd = (pt_t*)(pdpt->entries[pdpt_idx] & ~0xFFF);
+static registers_t* stop_handler(registers_t* r) {
+    lapic_eoi();
+    this_cpu()->nr_ipis++;
+    // May already have parked for this stop while polling
+    if (smp_stopping && smp_stopper != (int32_t)smp_processor_id()) smp_park();
+    return r;
+}
 
-    if (!(pd->entries[pd_idx] & PTE_PRESENT)) {
-        pt_t* new_pt = (pt_t*)pmm_alloc_page();
-        memset(new_pt, 0, PAGE_SIZE);
-        pd->entries[pd_idx] = (uint64_t)new_pt | PTE_PRESENT | PTE_RW | PTE_USER;
-    }
-    pt_t* pt = (pt_t*)(pd->entries[pd_idx] & ~0xFFF);
+static registers_t* spurious_handler(registers_t* r) {
+    return r;   // No EOI for spurious interrupts
+}
 
-    pt->entries[pt_idx] = phys | flags;
+// --- AP startup ---
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint64_t ap_boot_cr3, ap_kernel_cr3, ap_boot_stack, ap_boot_entry, ap_boot_cpu;
+
+// A trampoline data slot at the copy's address
+#define TRAMPOLINE_SLOT(sym) \
+    ((volatile uint64_t*)(AP_TRAMPOLINE_BASE + ((uint8_t*)&(sym) - ap_trampoline_start)))
+
+static void ap_main(uint64_t index) {
+    uint32_t id = (uint32_t)index;
+    gdt_install_cpu(id);
+    idt_load();
+    paging_init_cpu();
+    lapic_enable();
+    sched_init_cpu();
+    fpu_init_cpu();
+    lapic_timer_start();
+    cpus[id].online = true;
+    __asm__ __volatile__("sti");
+    // Idle: work arrives by IPI or is stolen on the APIC timer tick. The
+    // tick stops while halted; a busy CPU's tick kicks this one to steal.
+    for (;;) {
+        __asm__ __volatile__("cli");
+        tick_nohz_idle_enter();
+        __asm__ __volatile__("sti; hlt");
+    }
 }
 
-registers_t* page_fault_handler(registers_t *r) {
-    (void)r;
-    uint64_t faulting_address;
-    __asm__ __volatile__("mov %%cr2, %0" : "=r" (faulting_address));
-    
-    console_write("\n[CRITICAL] PAGE FAULT at 0x");
-    console_write_dec((uint32_t)faulting_address);
-    console_write("\nSystem Halted.\n");
-    __asm__ __volatile__("cli");
-    for(;;) { __asm__ __volatile__("hlt"); }
-    return r;
+static bool smp_boot_ap(uint32_t apic_id, uint32_t index) {
+    lapic_send(apic_id, ICR_ASSERT | ICR_INIT);
+    ndelay(10 * 1000 * 1000);
+    // Second SIPI only if the first was missed; the AP waits for neither
+    for (int attempt = 0; attempt < 2; attempt++) {
+        lapic_send(apic_id, ICR_ASSERT | ICR_STARTUP | (AP_TRAMPOLINE_BASE >> 12));
+        uint64_t deadline = ktime_get_ns() + (attempt ? 200 : 1) * 1000 * 1000ULL;
+        while (ktime_get_ns() < deadline) {
+            if (cpus[index].online) return true;
+            __asm__ volatile ("pause");
+        }
+    }
+    return false;
 }
 
-void paging_install(void) {
-    kernel_pml4 = (pt_t*)pmm_alloc_page();
-    memset(kernel_pml4, 0, PAGE_SIZE);
+void smp_init(void) {
+    vga_print_string("Starting application processors... ");
+    cpus[0].online = true;
+    spinlock_init(&smp_stop_lock);
 
-    // Map first 512MB of physical memory identity to cover Kernel, Heap, and PMM structures (mem_map)
-    // This prevents page faults when accessing memory management structures allocated beyond 4MB.
-    for (uint64_t i = 0; i < 0x20000000; i += PAGE_SIZE) {
-        paging_map(i, i, PTE_PRESENT | PTE_RW);
+    struct acpi_madt* madt = (struct acpi_madt*)acpi_find_table("APIC");
+    if (!madt) {
+        vga_print_string("no MADT, 1 CPU\n");
+        return;
     }
 
-    // Map Framebuffer
-    uint64_t fb_phys = screen_info.physbase;
-    // Calculate actual framebuffer size based on resolution and pitch
-    uint64_t fb_size = (uint64_t)screen_info.pitch * screen_info.resolution_y;
-    if (fb_phys != 0) {
-        for (uint64_t i = 0; i < fb_size; i += PAGE_SIZE) {
-            paging_map(fb_phys + i, fb_phys + i, PTE_PRESENT | PTE_RW);
+    uint64_t lapic_phys = madt->lapic_address;
+    uint8_t apic_ids[256];
+    uint32_t nr_apics = 0;
+    uint8_t* p = madt->entries;
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (p + 2 <= end && p[1] >= 2) {
+        if (p[0] == MADT_LOCAL_APIC && (*(uint32_t*)(p + 4) & MADT_LAPIC_ENABLED) && nr_apics < 256) {
+            apic_ids[nr_apics++] = p[3];
+        } else if (p[0] == MADT_LAPIC_OVERRIDE) {
+            lapic_phys = *(uint64_t*)(p + 4);
         }
+        p += p[1];
+    }
+
+    paging_map_range(lapic_phys, lapic_phys, PAGE_SIZE, PTE_PRESENT | PTE_RW | PTE_PCD | PTE_PWT);
+    lapic = (volatile uint32_t*)lapic_phys;
+    lapic_enable();
+    cpus[0].apic_id = lapic_id();
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+    register_interrupt_handler(RESCHED_VECTOR, resched_handler);
+    register_interrupt_handler(TLB_FLUSH_VECTOR, tlb_flush_handler);
+    register_interrupt_handler(STOP_VECTOR, stop_handler);
+    register_interrupt_handler(SPURIOUS_VECTOR, spurious_handler);
+    lapic_timer_calibrate();
+    if (lapic_timer_count) {
+        // Move CPU 0's tick from the PIT to its LAPIC: nohz idle can then
+        // sleep until the next timer instead of 16-bit PIT counts
+        unsigned long irq = local_irq_save();
+        outb(0x21, inb(0x21) | 0x01);   // Mask IRQ0 at the PIC
+        tick_lapic = true;
+        lapic_timer_start();
+        local_irq_restore(irq);
+    }
+
+    // The trampoline enables paging in 32-bit mode, so its first CR3 must be
+    // below 4 GB: a copy of the kernel PML4 (the shared slots are all it needs)
+    uint64_t* boot_pml4 = (uint64_t*)pmm_alloc_pages_zone(1, ZONE_DMA32);
+    if (!boot_pml4) {
+        vga_print_string("out of memory, 1 CPU\n");
+        return;
+    }
+    memcpy(boot_pml4, kernel_address_space.pml4, PAGE_SIZE);
+    memcpy((void*)AP_TRAMPOLINE_BASE, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    *TRAMPOLINE_SLOT(ap_boot_cr3) = (uint64_t)boot_pml4;
+    *TRAMPOLINE_SLOT(ap_kernel_cr3) = (uint64_t)kernel_address_space.pml4;
+    *TRAMPOLINE_SLOT(ap_boot_entry) = (uint64_t)ap_main;
+
+    for (uint32_t i = 0; i < nr_apics && nr_cpus_online < MAX_CPUS; i++) {
+        if (apic_ids[i] == cpus[0].apic_id) continue;
+        uint32_t index = nr_cpus_online;
+        // Backed up front: the AP runs on it before it can take page faults
+        uint8_t* stack = (uint8_t*)vmalloc_stack(TASK_STACK_SIZE);
+        if (!stack) break;
+        *TRAMPOLINE_SLOT(ap_boot_stack) = (uint64_t)(stack + TASK_STACK_SIZE);
+        *TRAMPOLINE_SLOT(ap_boot_cpu) = index;
+        cpus[index].apic_id = apic_ids[i];
+        if (smp_boot_ap(apic_ids[i], index)) {
+            nr_cpus_online++;
+        } else {
+            vfree(stack);
+        }
+    }
+    pmm_free_page(boot_pml4);
+
+    vga_print_dec(nr_cpus_online);
+    vga_print_string(" of ");
+    vga_print_dec(nr_apics);
+    vga_print_string(" CPUs online [OK]\n");
+}
+
+void smp_print_cpus(void) {
+    vga_print_string("\ncpu  apic  queued  switches  ipis  fpu traps\n");
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        vga_print_dec(i);
+        vga_print_string("    ");
+        vga_print_dec(cpus[i].apic_id);
+        vga_print_string("     ");
+        vga_print_dec(sched_nr_running(i));
+        vga_print_string("       ");
+        vga_print_dec((uint32_t)cpus[i].nr_switches);
+        vga_print_string("  ");
+        vga_print_dec((uint32_t)cpus[i].nr_ipis);
+        vga_print_string("  ");
+        vga_print_dec((uint32_t)cpus[i].nr_fpu_traps);
+        vga_print_string("\n");
     }
-    register_interrupt_handler(14, page_fault_handler);
-    
-    __asm__ __volatile__("mov %0, %%cr3" :: "r"(kernel_pml4));
 }
 
 // ==========================================
-// FILE: timer.c
+// FILE: fpu.c
 // ==========================================
-volatile uint32_t ticks = 0;
-extern task_t* ready_queue; // Forward declare from task.c section
-registers_t* timer_handler(registers_t *r) {
-    ticks++;
-
-    // Wake up sleeping tasks
-    if (ready_queue) {
-        task_t* current = ready_queue;
-        do {
-            if (current->state == TASK_SLEEPING && ticks >= current->wake_at_tick) {
-                current->state = TASK_READY;
-            }
-            current = current->next;
-        } while (current != ready_queue);
+// Lazy FPU/SSE/AVX switching. CR0.TS is set whenever a task is switched in,
+// so its first SIMD instruction traps (#NM) and only then is its state
+// loaded. A task that used the FPU during its slice is saved on the way
+// out; one that did not costs nothing. The registers are left loaded after
+// the save, so a task coming straight back to the same CPU skips the restore.
+// The kernel itself is built without SSE and only touches SIMD registers
+// between kernel_fpu_begin() and kernel_fpu_end().
+
+#define CR0_MP      (1 << 1)
+#define CR0_EM      (1 << 2)
+#define CR0_TS      (1 << 3)
+#define CR0_NE      (1 << 5)
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+#define CR4_OSXSAVE     (1 << 18)
+
+#define XFEATURE_X87  (1 << 0)
+#define XFEATURE_SSE  (1 << 1)
+#define XFEATURE_AVX  (1 << 2)
+
+static bool fpu_use_xsave = false;
+static bool fpu_use_xsaveopt = false;
+static uint64_t fpu_xfeatures = 0;     // XCR0: components saved by XSAVE
+static uint32_t fpu_state_size = 512;  // FXSAVE area unless XSAVE says otherwise
+
+static inline void clts(void) {
+    __asm__ volatile("clts");
+}
+
+static inline void stts(void) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS));
+}
+
+static void fpu_save(void* area) {
+    uint32_t lo = (uint32_t)fpu_xfeatures, hi = (uint32_t)(fpu_xfeatures >> 32);
+    if (fpu_use_xsaveopt) __asm__ volatile("xsaveopt64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else if (fpu_use_xsave) __asm__ volatile("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else __asm__ volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+}
+
+static void fpu_restore(const void* area) {
+    uint32_t lo = (uint32_t)fpu_xfeatures, hi = (uint32_t)(fpu_xfeatures >> 32);
+    if (fpu_use_xsave) __asm__ volatile("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else __asm__ volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+}
+
+// A save area holding the power-on state: x87 control word 0x37F, all
+// exceptions masked in MXCSR, and an empty XSAVE header (every component
+// in its init state).
+static void* fpu_alloc_state(void) {
+    uint8_t* area = (uint8_t*)kmalloc_aligned(fpu_state_size, 64);
+    if (!area) return NULL;
+    memset(area, 0, fpu_state_size);
+    *(uint16_t*)(area + 0) = 0x37F;
+    *(uint32_t*)(area + 24) = 0x1F80;
+    return area;
+}
+
+// #NM: the current task used the FPU with CR0.TS set.
+static registers_t* fpu_trap_handler(registers_t* r) {
+    cpu_t* cpu = this_cpu();
+    task_t* task = cpu->current;
+    clts();
+    cpu->fpu_active = true;
+    cpu->nr_fpu_traps++;
+    // Its registers are still loaded if nothing else ran SIMD here since
+    if (cpu->fpu_owner == task && task->fpu_cpu == cpu->id) return r;
+
+    if (!task->fpu_state) {
+        task->fpu_state = fpu_alloc_state();
+        if (!task->fpu_state) {
+            console_write("\nFPU: no memory for task ");
+            console_write_dec(task->id);
+            console_write("\nSystem Halted.\n");
+            __asm__ __volatile__("cli");
+            for(;;) { __asm__ __volatile__("hlt"); }
+        }
     }
-
-    return schedule(r);
+    fpu_restore(task->fpu_state);
+    cpu->fpu_owner = task;
+    task->fpu_cpu = cpu->id;
+    return r;
 }
-uint32_t get_ticks() {
-    return ticks;
+
+// Called by schedule() with the run queue locked, only if prev trapped in
+// (CR0.TS clear) during its slice.
+void fpu_switch_out(task_t* prev) {
+    cpu_t* cpu = this_cpu();
+    fpu_save(prev->fpu_state);
+    stts();
+    cpu->fpu_active = false;
 }
-void timer_install() {
-    int frequency = 100;
-    uint32_t divisor = 1193180 / frequency;
-    outb(0x43, 0x36);
-    uint8_t l = (uint8_t)(divisor & 0xFF);
-    uint8_t h = (uint8_t)((divisor >> 8) & 0xFF);
-    outb(0x40, l);
-    outb(0x40, h);
-    irq_install_handler(0, timer_handler); 
+
+// Kernel SIMD section. Runs with interrupts off, so it must be short and
+// must not sleep; usable from interrupt handlers. Does not nest.
+void kernel_fpu_begin(void) {
+    unsigned long flags = local_irq_save();
+    cpu_t* cpu = this_cpu();
+    if (cpu->fpu_active) {
+        // The current task's registers are newer than its save area
+        fpu_save(cpu->current->fpu_state);
+    } else {
+        clts();
+    }
+    cpu->fpu_owner = NULL;   // About to be clobbered
+    cpu->fpu_irq_flags = flags;
+}
+
+void kernel_fpu_end(void) {
+    cpu_t* cpu = this_cpu();
+    stts();
+    cpu->fpu_active = false;   // The task traps and reloads on its next use
+    local_irq_restore(cpu->fpu_irq_flags);
+}
+
+// Enables FXSR/XSAVE on the calling CPU and leaves CR0.TS set.
+void fpu_init_cpu(void) {
+    uint64_t cr0, cr4;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE;
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0 & ~CR0_TS));
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_use_xsave) cr4 |= CR4_OSXSAVE;
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4));
+    if (fpu_use_xsave) {
+        __asm__ volatile("xsetbv" :: "c"(0), "a"((uint32_t)fpu_xfeatures), "d"((uint32_t)(fpu_xfeatures >> 32)));
+    }
+    __asm__ volatile("fninit");
+    this_cpu()->fpu_owner = NULL;
+    this_cpu()->fpu_active = false;
+    stts();
+}
+
+void fpu_init(void) {
+    vga_print_string("Enabling lazy FPU switching... ");
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (((ecx >> 26) & 1)) {
+        // XSAVE: x87, SSE and AVX. AVX-512 state is left disabled to keep
+        // the per-task area small.
+        uint32_t xeax, xebx, xecx, xedx;
+        cpuid(0xD, 0, &xeax, &xebx, &xecx, &xedx);
+        fpu_use_xsave = true;
+        fpu_xfeatures = XFEATURE_X87 | XFEATURE_SSE;
+        if (((ecx >> 28) & 1) && (xeax & XFEATURE_AVX)) fpu_xfeatures |= XFEATURE_AVX;
+        cpuid(0xD, 1, &xeax, &xebx, &xecx, &xedx);
+        fpu_use_xsaveopt = xeax & 1;
+    }
+    fpu_init_cpu();
+    if (fpu_use_xsave) {
+        // EBX reports the area size for the components now enabled in XCR0
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        fpu_state_size = ebx;
+    }
+    register_interrupt_handler(7, fpu_trap_handler);
+    vga_print_string(fpu_use_xsaveopt ? "xsaveopt" : fpu_use_xsave ? "xsave" : "fxsave");
+    if (fpu_xfeatures & XFEATURE_AVX) vga_print_string("+avx");
+    vga_print_string(", ");
+    vga_print_dec(fpu_state_size);
+    vga_print_string(" bytes per task [OK]\n");
 }
 
 // ==========================================
@@ -1423,6 +4383,7 @@ registers_t* keyboard_handler(registers_t *r) {
                     key_buffer[buffer_end] = ch;
                     buffer_end = next_end;
                 }
+                input_notify();
             }
         }
     }
@@ -1504,6 +4465,7 @@ static registers_t* mouse_handler(registers_t *regs) {
             mouse_y -= packet.y_delta; // Invert Y axis
             mouse_buttons = packet.flags & 0x07;
             packet_byte_index = 0;
+            input_notify();
         }
     }
     return regs;
@@ -1593,7 +4555,7 @@ void rtl8139_init(void) {
     outb(rtl8139_io_base + REG_CONFIG_1, 0x00);
     outb(rtl8139_io_base + REG_COMMAND, 0x10);
     while((inb(rtl8139_io_base + REG_COMMAND) & 0x10) != 0) { /* wait */ }
-    rx_buffer = (uint8_t*)pmm_alloc_pages(4);
+    rx_buffer = (uint8_t*)pmm_alloc_pages_zone(4, ZONE_DMA32); // 32-bit bus master
     outl(rtl8139_io_base + REG_RX_BUF, (uintptr_t)rx_buffer);
     outw(rtl8139_io_base + REG_IMR, 0x0005);
     outl(rtl8139_io_base + REG_RCR, 0x0F);
@@ -1746,6 +4708,11 @@ void console_write(const char* str) {
         }
     }
 }
+void console_write_hex(uint64_t n) {
+    char buf[17]; char* p = &buf[16]; *p = '\0';
+    do { *--p = "0123456789ABCDEF"[n & 0xF]; n >>= 4; } while (n > 0);
+    console_write(p);
+}
 void console_write_dec(uint32_t n) {
     if (n == 0) { console_write("0"); return; }
     char buf[11]; char* p = &buf[10]; *p = '\0';
@@ -1768,86 +4735,475 @@ void syscall_handler(registers_t *r){
 // ==========================================
 // FILE: task.c
 // ==========================================
-task_t* current_task = NULL;
-task_t* ready_queue = NULL;
+task_t* task_list = NULL;      // Every task, circular through ->next
+static spinlock_t task_list_lock;
 static int next_pid = 1;
+static Cache task_cache;
+static uint32_t tasks_spawned = 0, tasks_reaped = 0;
+
+static task_t* task_spawn(const char* name, void (*entry_point)(void), address_space_t* as, int priority, int target);
+
+// --- O(1) priority scheduler ---
+// One FIFO run queue per priority and a bitmap of the non-empty ones:
+// picking the next task is a find-first-set, independent of how many tasks
+// exist. READY tasks are queued; the RUNNING task is not. Higher priorities
+// get longer slices and preempt lower ones as soon as they become ready.
+// Each CPU owns a set of queues under its own lock: new tasks go to the
+// least loaded CPU, and a CPU with nothing queued steals from the busiest.
+typedef struct {
+    spinlock_t lock;
+    task_t* head[SCHED_PRIORITIES];
+    task_t* tail[SCHED_PRIORITIES];
+    uint64_t bitmap;
+    volatile uint32_t nr_running;   // Queued tasks, not counting the running one
+} runqueue_t;
+
+static runqueue_t runqueues[MAX_CPUS];
+static task_t* input_waiter = NULL;
+
+static inline uint32_t sched_slice(int priority) {
+    return 1 + (SCHED_PRIORITIES - 1 - priority) / 8;  // 8 ticks at 0 down to 1 at 63
+}
+
+static void rq_enqueue(runqueue_t* rq, task_t* t, bool front) {
+    int prio = t->priority;
+    if (front) {
+        t->run_next = rq->head[prio];
+        rq->head[prio] = t;
+        if (!rq->tail[prio]) rq->tail[prio] = t;
+    } else {
+        t->run_next = NULL;
+        if (rq->tail[prio]) rq->tail[prio]->run_next = t;
+        else rq->head[prio] = t;
+        rq->tail[prio] = t;
+    }
+    rq->bitmap |= 1ULL << prio;
+    rq->nr_running++;
+}
+
+// Removes t, which follows prev (NULL if it is the head) in its queue.
+static void rq_unlink(runqueue_t* rq, task_t* t, task_t* prev) {
+    int prio = t->priority;
+    if (prev) prev->run_next = t->run_next;
+    else rq->head[prio] = t->run_next;
+    if (rq->tail[prio] == t) rq->tail[prio] = prev;
+    if (!rq->head[prio]) rq->bitmap &= ~(1ULL << prio);
+    rq->nr_running--;
+    t->run_next = NULL;
+}
+
+static task_t* rq_dequeue(runqueue_t* rq) {
+    if (!rq->bitmap) return NULL;
+    task_t* t = rq->head[__builtin_ctzll(rq->bitmap)];
+    rq_unlink(rq, t, NULL);
+    return t;
+}
+
+// Takes the best queued task from the busiest other CPU. The caller holds
+// its own queue lock, so the victim's is only tried: two CPUs stealing
+// from each other must not deadlock.
+static task_t* rq_steal(uint32_t self) {
+    uint32_t victim = self, most = 0;
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        if (i != self && runqueues[i].nr_running > most) {
+            most = runqueues[i].nr_running;
+            victim = i;
+        }
+    }
+    if (victim == self) return NULL;
+    runqueue_t* rq = &runqueues[victim];
+    if (!spinlock_trylock(&rq->lock)) return NULL;
+    task_t* stolen = NULL;
+    for (uint64_t bits = rq->bitmap; bits && !stolen; bits &= bits - 1) {
+        task_t* prev = NULL;
+        for (task_t* t = rq->head[__builtin_ctzll(bits)]; t; prev = t, t = t->run_next) {
+            if (t->on_cpu || t->pinned) continue;   // on_cpu: its old CPU is still switching away
+            rq_unlink(rq, t, prev);
+            t->cpu = self;
+            stolen = t;
+            break;
+        }
+    }
+    spinlock_release(&rq->lock);
+    return stolen;
+}
+
+// Asks cpu to reschedule at its next interrupt exit, kicking it if remote.
+static void resched_cpu(uint32_t cpu) {
+    cpus[cpu].need_resched = true;
+    if (cpu != smp_processor_id()) smp_send_reschedule(cpu);
+}
 
 void idle_task_func(void){
-    while(1) { __asm__ __volatile__("hlt"); }
+    while(1) {
+        // Spend spare cycles pre-zeroing pages; halt once the pool is full
+        if (zero_pool_refill()) continue;
+        // Stop the periodic tick until the next timer is due; sti; hlt has
+        // no window for an interrupt to slip in between
+        __asm__ __volatile__("cli");
+        tick_nohz_idle_enter();
+        __asm__ __volatile__("sti; hlt");
+    }
 }
 task_t* get_current_task(void) {
-    return current_task;
+    return this_cpu()->current;
 }
-void tasking_install(void) {
-    vga_print_string("Initializing multitasking... ");
-    current_task = (task_t*)pmm_alloc_page();
-    memset(current_task, 0, sizeof(task_t));
-    current_task->id = next_pid++;
-    current_task->state = TASK_RUNNING;
-    current_task->kernel_stack = NULL; 
-    current_task->next = NULL;
-    ready_queue = current_task; 
-    vga_print_string("[OK]\n");
+
+// Seeds a stack so that switch_to "returns" into fn: six zeroed
+// callee-saved registers, fn's address, then a null return address for fn
+// that also keeps the ABI's 16-byte alignment at its entry.
+static uint64_t task_stack_init(void* top, void (*fn)(void)) {
+    uint64_t* sp = (uint64_t*)top;
+    *--sp = 0;
+    *--sp = (uint64_t)fn;
+    for (int i = 0; i < 6; i++) *--sp = 0;   // r15 .. rbx
+    return (uint64_t)sp;
 }
-void schedule_from_yield(void){
-    __asm__ __volatile__("int $0x20");
+
+// Runs on the incoming task's stack right after switch_to: the task we
+// switched away from is fully saved now, so another CPU may resume it.
+static void finish_switch(void) {
+    cpu_t* cpu = this_cpu();
+    task_t* prev = cpu->switched_out;
+    cpu->switched_out = NULL;
+    if (prev) prev->on_cpu = false;
 }
-void create_task(char* name, void (*entry_point)(void)) {
-    (void)name; 
-    __asm__ __volatile__("cli");
-    task_t* new_task = (task_t*)pmm_alloc_page();
+
+// First code a new task runs, entered from switch_to with interrupts off.
+static void task_bootstrap(void) {
+    finish_switch();
+    __asm__ __volatile__("sti");
+    get_current_task()->entry();
+    task_exit();
+}
+
+// --- Kernel stacks ---
+// Fully backed from the vmalloc window, with an unmapped guard page on each
+// side. Released stacks are kept for reuse with their pages still mapped, so
+// a short-lived task neither reserves address space nor allocates frames.
+#define STACK_POOL_MAX 16
+static void* stack_pool[STACK_POOL_MAX];   // Stack tops
+static uint32_t stack_pool_count = 0;
+static spinlock_t stack_pool_lock;
+
+static void* task_stack_alloc(void) {
+    unsigned long irq = spinlock_acquire_irqsave(&stack_pool_lock);
+    void* top = stack_pool_count ? stack_pool[--stack_pool_count] : NULL;
+    spinlock_release_irqrestore(&stack_pool_lock, irq);
+    if (top) return top;
+    uint8_t* base = (uint8_t*)vmalloc_stack(TASK_STACK_SIZE);
+    return base ? base + TASK_STACK_SIZE : NULL;
+}
+
+static void task_stack_free(void* top) {
+    unsigned long irq = spinlock_acquire_irqsave(&stack_pool_lock);
+    if (stack_pool_count < STACK_POOL_MAX) {
+        stack_pool[stack_pool_count++] = top;
+        top = NULL;
+    }
+    spinlock_release_irqrestore(&stack_pool_lock, irq);
+    if (top) vfree((uint8_t*)top - TASK_STACK_SIZE);
+}
+
+// Builds a task that is not yet on any run queue. Returns NULL if out of memory.
+static void sleep_timeout(void* data);
+
+static task_t* task_alloc(const char* name, void (*entry_point)(void), address_space_t* as, int priority) {
+    task_t* new_task = (task_t*)kmem_cache_alloc(&task_cache);
+    if (!new_task) return NULL;
     memset(new_task, 0, sizeof(task_t));
+    new_task->name = name;
+    // Set up once; sleep() only re-arms it, so it is never reset while linked
+    timer_setup(&new_task->sleep_timer, sleep_timeout, new_task);
+    new_task->priority = priority;
+    new_task->time_slice = sched_slice(priority);
+    new_task->fpu_cpu = ~0u;   // No CPU's registers hold its FPU state yet
+    if (entry_point) {
+        new_task->kernel_stack = task_stack_alloc();
+        if (!new_task->kernel_stack) {
+            kmem_cache_free(&task_cache, new_task);
+            return NULL;
+        }
+        new_task->entry = entry_point;
+        new_task->rsp = task_stack_init(new_task->kernel_stack, task_bootstrap);
+    }
+    new_task->as = as_get(as);
 
+    unsigned long irq = spinlock_acquire_irqsave(&task_list_lock);
     new_task->id = next_pid++;
-    new_task->state = TASK_READY;
-    new_task->kernel_stack = (void*)((uintptr_t)pmm_alloc_page() + PAGE_SIZE);
-    new_task->regs.rip = (uint64_t)entry_point;
-    new_task->regs.cs = 0x08;
-    new_task->regs.rflags = 0x202;
-    new_task->regs.rsp = (uint64_t)new_task->kernel_stack;
-    new_task->regs.ss = 0x10;
-    
-    task_t* temp = ready_queue;
-    while (temp->next != NULL) temp = temp->next;
-    temp->next = new_task;
-    new_task->next = ready_queue; 
-    __asm__ __volatile__("sti");
+    tasks_spawned++;
+    if (task_list) {
+        new_task->next = task_list->next;
+        task_list->next = new_task;
+    } else {
+        new_task->next = new_task;
+        task_list = new_task;
+    }
+    spinlock_release_irqrestore(&task_list_lock, irq);
+    return new_task;
 }
 
-registers_t* schedule(registers_t* r) {
-    if (!current_task) return r;
+// --- Exit and reaping ---
+// An exiting task cannot free the stack it is running on, so it queues
+// itself as a zombie and the reaper task frees it once its CPU has
+// switched away.
+static task_t* zombie_list = NULL;   // Linked through run_next
+static spinlock_t zombie_lock;
+static task_t* reaper = NULL;
 
-    // Save current task's context
-    current_task->regs = *r;
-    task_t* next_task = current_task->next;
-    while (next_task && next_task->state != TASK_READY) {
-        next_task = next_task->next;
-        if (next_task == current_task) {
-            next_task = current_task;
-            break;
+void task_exit(void) {
+    __asm__ __volatile__("cli");
+    task_t* self = get_current_task();
+    spinlock_acquire(&zombie_lock);
+    self->state = TASK_ZOMBIE;
+    self->run_next = zombie_list;
+    zombie_list = self;
+    spinlock_release(&zombie_lock);
+    if (reaper) task_wake(reaper);
+    schedule();
+    for (;;) { __asm__ __volatile__("hlt"); }   // Never picked again
+}
+
+static void task_reap(task_t* t) {
+    while (t->on_cpu) { __asm__ volatile ("pause"); }   // Still switching away
+
+    unsigned long irq = spinlock_acquire_irqsave(&task_list_lock);
+    task_t* prev = task_list;
+    while (prev->next != t) prev = prev->next;
+    prev->next = t->next;
+    if (task_list == t) task_list = t->next;
+    tasks_reaped++;
+    spinlock_release_irqrestore(&task_list_lock, irq);
+
+    t->state = TASK_DEAD;
+    if (t->fpu_state) kfree(t->fpu_state);
+    if (t->kernel_stack) task_stack_free(t->kernel_stack);
+    as_put(t->as);
+    kmem_cache_free(&task_cache, t);
+}
+
+static void reaper_func(void) {
+    for (;;) {
+        unsigned long irq = spinlock_acquire_irqsave(&zombie_lock);
+        task_t* list = zombie_list;
+        zombie_list = NULL;
+        if (!list) {
+            get_current_task()->state = TASK_BLOCKED;
+            schedule_and_release_lock(&zombie_lock, irq);
+            continue;
+        }
+        spinlock_release_irqrestore(&zombie_lock, irq);
+        while (list) {
+            task_t* next = list->run_next;
+            task_reap(list);
+            list = next;
         }
     }
+}
+
+void tasking_install(void) {
+    vga_print_string("Initializing multitasking... ");
+    spinlock_init(&task_list_lock);
+    spinlock_init(&stack_pool_lock);
+    spinlock_init(&zombie_lock);
+    kmem_cache_init(&task_cache, "task", sizeof(task_t), NULL, NULL);
+    for (int i = 0; i < MAX_CPUS; i++) spinlock_init(&runqueues[i].lock);
+    // The boot task becomes the GUI loop
+    task_t* boot = task_alloc("main", NULL, &kernel_address_space, PRIO_INTERACTIVE);
+    boot->state = TASK_RUNNING;
+    boot->on_cpu = true;
+    this_cpu()->current = boot;
+    reaper = task_spawn("reaper", reaper_func, &kernel_address_space, PRIO_BATCH, -1);
+    vga_print_string("[OK]\n");
+}
 
-    // If the task was running, it's now ready to be scheduled again, unless it's sleeping/blocked
-    if (current_task->state == TASK_RUNNING) {
-        current_task->state = TASK_READY;
+// Gives the calling CPU the task it runs when its queues are empty.
+void create_idle_task(void (*entry_point)(void)) {
+    task_t* idle = task_alloc("idle", entry_point, &kernel_address_space, PRIO_IDLE);
+    idle->state = TASK_READY;
+    idle->cpu = smp_processor_id();
+    this_cpu()->idle = idle;
+}
+
+// Called on an AP: its boot context becomes its idle task.
+void sched_init_cpu(void) {
+    cpu_t* cpu = this_cpu();
+    task_t* idle = task_alloc("idle", NULL, &kernel_address_space, PRIO_IDLE);
+    idle->state = TASK_RUNNING;
+    idle->on_cpu = true;
+    idle->cpu = cpu->id;
+    cpu->idle = idle;
+    cpu->current = idle;
+}
+
+uint32_t sched_nr_running(uint32_t cpu) {
+    return runqueues[cpu].nr_running;
+}
+
+// Voluntary switch: a plain call into schedule(), no trap frame needed.
+void schedule_from_yield(void) {
+    unsigned long irq = local_irq_save();
+    cpu_t* cpu = this_cpu();
+    task_t* curr = cpu->current;
+    // A yield gives up the rest of the slice
+    if (curr && curr->state == TASK_RUNNING) curr->time_slice = 0;
+    cpu->need_resched = true;
+    schedule();
+    local_irq_restore(irq);
+}
+
+// Load of a CPU: what is queued plus whatever it is running.
+static uint32_t sched_pick_cpu(void) {
+    uint32_t best = smp_processor_id(), best_load = ~0u;
+    for (uint32_t i = 0; i < nr_cpus_online; i++) {
+        uint32_t load = runqueues[i].nr_running + (cpus[i].current != cpus[i].idle);
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
     }
-    current_task = next_task;
+    return best;
+}
 
-    // Find the next ready task to run in the circular list
-    task_t* next = current_task;
-    do {
-        next = next->next;
-    } while (next->state != TASK_READY);
-    // This simple loop works because the main kernel task (acting as idle) never sleeps,
-    // so there is always at least one ready task in the queue.
+// Queues a new task on CPU target, pinned there, or on the least loaded CPU if target < 0.
+static task_t* task_spawn(const char* name, void (*entry_point)(void), address_space_t* as, int priority, int target) {
+    task_t* new_task = task_alloc(name, entry_point, as, priority);
+    if (!new_task) return NULL;
+    new_task->state = TASK_READY;
+    new_task->pinned = target >= 0;
+
+    unsigned long irq = local_irq_save();
+    uint32_t cpu = target >= 0 ? (uint32_t)target : sched_pick_cpu();
+    runqueue_t* rq = &runqueues[cpu];
+    spinlock_acquire(&rq->lock);
+    new_task->cpu = cpu;
+    rq_enqueue(rq, new_task, false);
+    if (cpus[cpu].current && priority < cpus[cpu].current->priority) resched_cpu(cpu);
+    spinlock_release(&rq->lock);
+    local_irq_restore(irq);
+    return new_task;
+}
+
+void create_task(const char* name, void (*entry_point)(void)) {
+    task_spawn(name, entry_point, &kernel_address_space, PRIO_DEFAULT, -1);
+}
+
+void create_task_prio(const char* name, void (*entry_point)(void), int priority) {
+    if (priority < 0) priority = 0;
+    if (priority >= SCHED_PRIORITIES) priority = SCHED_PRIORITIES - 1;
+    task_spawn(name, entry_point, &kernel_address_space, priority, -1);
+}
+
+void create_task_in(const char* name, void (*entry_point)(void), address_space_t* as) {
+    task_spawn(name, entry_point, as, PRIO_DEFAULT, -1);
+}
+
+// Makes a sleeping or blocked task runnable on the CPU it last ran on.
+// Safe from interrupt handlers and from any CPU.
+void task_wake(task_t* task) {
+    unsigned long irq = local_irq_save();
+    uint32_t cpu = task->cpu;   // Stable: only queued READY tasks migrate
+    runqueue_t* rq = &runqueues[cpu];
+    spinlock_acquire(&rq->lock);
+    task_state_t state = task->state;
+    if (state == TASK_SLEEPING || state == TASK_BLOCKED || state == TASK_WAITING) {
+        // Cancel before it can run: once READY it may sleep() again on
+        // another CPU and re-arm this timer. rq->lock nests outside timer_lock.
+        if (state == TASK_SLEEPING) timer_cancel(&task->sleep_timer);
+        task->state = TASK_READY;
+        rq_enqueue(rq, task, false);
+        task_t* curr = cpus[cpu].current;
+        if (curr && task->priority < curr->priority) resched_cpu(cpu);
+    }
+    spinlock_release(&rq->lock);
+    local_irq_restore(irq);
+}
+
+// Timer tick: charge the running task and ask for a switch once its slice is used up.
+void scheduler_tick(void) {
+    cpu_t* cpu = this_cpu();
+    task_t* curr = cpu->current;
+    if (!curr) return;
+    if (curr == cpu->idle) {
+        // Look for work to steal once a tick
+        if (nr_cpus_online > 1) cpu->need_resched = true;
+        return;
+    }
+    if (curr->time_slice) curr->time_slice--;
+    if (curr->time_slice == 0) cpu->need_resched = true;
+    tick_nohz_kick_idle(runqueues[cpu->id].nr_running);
+}
+
+// Picks the next task and switches stacks to it. Called with interrupts
+// off, on interrupt exit or from a voluntary yield; returns when prev is
+// scheduled again, possibly on another CPU. Each task's trap frame stays
+// on its own stack, so only callee-saved registers move.
+void schedule(void) {
+    cpu_t* cpu = this_cpu();
+    task_t* prev = cpu->current;
+    if (!prev) return;
+    runqueue_t* rq = &runqueues[cpu->id];
+
+    spinlock_acquire(&rq->lock);
+    bool running = prev->state == TASK_RUNNING;
+    bool is_idle = prev == cpu->idle;
+    if (running && !cpu->need_resched) {
+        bool higher = rq->bitmap && (int)__builtin_ctzll(rq->bitmap) < prev->priority;
+        if (!higher) goto keep;
+    }
+    if (running && !is_idle && !rq->bitmap) {
+        // Nothing else to run here: start a fresh slice
+        prev->time_slice = sched_slice(prev->priority);
+        goto keep;
+    }
 
-    // Switch to the next task
-    current_task = next;
-    current_task->state = TASK_RUNNING;
+    task_t* next = rq_dequeue(rq);
+    if (!next && (is_idle || !running)) next = rq_steal(cpu->id);
+    if (!next) {
+        if (running) goto keep;
+        next = cpu->idle;
+    }
+    if (next == prev) {
+        // Woken again before it managed to switch out
+        prev->state = TASK_RUNNING;
+        goto keep;
+    }
+
+    if (running && !is_idle) {
+        prev->state = TASK_READY;
+        // Preempted tasks resume first within their priority; expired ones go last
+        bool front = prev->time_slice != 0;
+        if (!front) prev->time_slice = sched_slice(prev->priority);
+        rq_enqueue(rq, prev, front);
+    } else if (is_idle) {
+        prev->state = TASK_READY;
+    }
+    if (cpu->fpu_active) fpu_switch_out(prev);
+    cpu->switched_out = prev;   // Still on_cpu until switch_to has saved it
+
+    next->state = TASK_RUNNING;
+    next->on_cpu = true;
+    next->cpu = cpu->id;
+    if (next->time_slice == 0) next->time_slice = sched_slice(next->priority);
+    cpu->current = next;
+    cpu->need_resched = false;
+    cpu->nr_switches++;
+    spinlock_release(&rq->lock);
+    as_switch(next->as);
+
+    switch_to(&prev->rsp, next->rsp);
+    finish_switch();
+    return;
+
+keep:
+    cpu->need_resched = false;
+    spinlock_release(&rq->lock);
+}
 
-    // Load next task's context
-    return &current_task->regs;
+// On the way out of an interrupt: switch if the slice ran out or a wakeup
+// made a higher-priority task ready.
+void schedule_irq_exit(void) {
+    if (this_cpu()->need_resched) schedule();
 }
 
 void schedule_and_release_lock(spinlock_t* lock, unsigned long flags) {
@@ -1855,22 +5211,118 @@ void schedule_and_release_lock(spinlock_t* lock, unsigned long flags) {
     schedule_from_yield();
 }
 
+static void sleep_timeout(void* data) {
+    task_wake((task_t*)data);
+}
+
 void sleep(uint32_t ms) {
     // Timer is 100Hz, so 1 tick = 10ms.
     uint32_t delay_ticks = ms / 10;
     if (delay_ticks == 0 && ms > 0) {
         delay_ticks = 1; // Sleep for at least one tick if ms > 0
     }
-    uint32_t wake_tick = get_ticks() + delay_ticks;
 
     task_t* task = get_current_task();
     if (task) {
+        // Arm the timer before a tick can switch us out as SLEEPING
+        unsigned long irq = local_irq_save();
         task->state = TASK_SLEEPING;
-        task->wake_at_tick = wake_tick;
+        timer_add(&task->sleep_timer, get_ticks() + delay_ticks);
+        local_irq_restore(irq);
         schedule_from_yield(); // Force a context switch
     }
 }
 
+// Sleeps until input arrives or ms pass, whichever is first.
+void input_wait(uint32_t ms) {
+    input_waiter = get_current_task();
+    sleep(ms);
+    input_waiter = NULL;
+}
+
+// Called by the keyboard and mouse handlers.
+void input_notify(void) {
+    if (input_waiter) task_wake(input_waiter);
+}
+
+void task_print_all(void) {
+    static const char* state_names[] = {
+        "running", "ready", "sleeping", "dead", "blocked", "waiting", "killed", "zombie"
+    };
+    vga_print_string("\npid  cpu  prio  state     name\n");
+    unsigned long irq = spinlock_acquire_irqsave(&task_list_lock);
+    task_t* t = task_list;
+    do {
+        vga_print_dec(t->id);
+        vga_print_string(t->id < 10 ? "    " : t->id < 100 ? "   " : "  ");
+        vga_print_dec(t->cpu);
+        vga_print_string("    ");
+        vga_print_dec(t->priority);
+        vga_print_string(t->priority < 10 ? "     " : "    ");
+        vga_print_string(state_names[t->state]);
+        for (size_t n = strlen(state_names[t->state]); n < 10; n++) vga_print_string(" ");
+        vga_print_string(t->name ? t->name : "-");
+        vga_print_string("\n");
+        t = t->next;
+    } while (t != task_list);
+    uint32_t spawned = tasks_spawned, reaped = tasks_reaped;
+    spinlock_release_irqrestore(&task_list_lock, irq);
+    vga_print_string("spawned ");
+    vga_print_dec(spawned);
+    vga_print_string(", reaped ");
+    vga_print_dec(reaped);
+    vga_print_string(", pooled stacks ");
+    vga_print_dec(stack_pool_count);
+    vga_print_string("\n");
+}
+
+// --- Context switch benchmark ---
+#define SCHED_BENCH_ROUNDS 10000
+
+static uint64_t bench_main_rsp, bench_helper_rsp;
+static uint8_t bench_stack[4096] __attribute__((aligned(16)));
+static volatile bool bench_stop;
+
+// Bounces straight back, so the loop measures switch_to alone.
+static void bench_helper(void) {
+    for (;;) switch_to(&bench_helper_rsp, bench_main_rsp);
+}
+
+static void bench_partner(void) {
+    while (!bench_stop) schedule_from_yield();
+}
+
+static void sched_bench_task(void) {
+    // Interrupts stay off so nothing else runs on the helper's stack
+    bench_helper_rsp = task_stack_init(bench_stack + sizeof(bench_stack), bench_helper);
+    unsigned long irq = local_irq_save();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SCHED_BENCH_ROUNDS; i++) switch_to(&bench_main_rsp, bench_helper_rsp);
+    uint64_t raw = (rdtsc() - start) / (2 * SCHED_BENCH_ROUNDS);
+    local_irq_restore(irq);
+
+    // The whole voluntary path: two tasks on this CPU yielding to each other
+    bench_stop = false;
+    task_spawn("ctxbench-peer", bench_partner, &kernel_address_space, PRIO_INTERACTIVE - 1, (int)smp_processor_id());
+    schedule_from_yield();   // Let the partner start
+    start = rdtsc();
+    for (int i = 0; i < SCHED_BENCH_ROUNDS; i++) schedule_from_yield();
+    uint64_t yield = (rdtsc() - start) / (2 * SCHED_BENCH_ROUNDS);
+    bench_stop = true;
+    schedule_from_yield();
+
+    vga_print_string("\nswitch_to:           ");
+    vga_print_dec((uint32_t)raw);
+    vga_print_string(" cycles\nyield to yield:      ");
+    vga_print_dec((uint32_t)yield);
+    vga_print_string(" cycles per switch\n");
+}
+
+// Runs the benchmark in a task pinned to this CPU; prints when done.
+void sched_bench(void) {
+    task_spawn("ctxbench", sched_bench_task, &kernel_address_space, PRIO_INTERACTIVE - 1, (int)smp_processor_id());
+}
+
 // ==========================================
 // FILE: widget.c
 // ==========================================
@@ -2073,7 +5525,7 @@ Widget* create_scrollbar(int x,int y,int width,int height,uint32_t bg_color,uint
     return widget;
 }
 void init_widget_system(){
-    widget_cache = kmem_cache_create(sizeof(Widget));
+    kmem_cache_init(&widget_cache, "widget", sizeof(Widget), NULL, NULL);
     if(!g_widget_font) vga_print_string("Failed to load widget font\n");
 }
 
@@ -2312,6 +5764,237 @@ void window_update_all(Window* head,FrameBuffer* fb){
     spinlock_release(&wm_lock);
 }
 
+// ==========================================
+// FILE: zram.c
+// ==========================================
+// Compressed RAM block device. Each 4 KB page is stored LZ4-compressed in a
+// kmalloc size class; zero-filled pages take no storage at all, and pages
+// that barely compress are kept raw. Usable as a swap target via the page
+// interface or as a scratch disk via the sector interface.
+#define ZRAM_MAX_COMPRESSED 3072   // Anything larger is stored uncompressed
+#define ZRAM_SECTOR_SIZE    512
+
+#define ZRAM_ENTRY_ZERO 0x1
+#define ZRAM_ENTRY_RAW  0x2
+
+typedef struct {
+    void* data;
+    uint16_t len;
+    uint8_t flags;
+} zram_entry_t;
+
+struct zram {
+    spinlock_t lock;
+    uint32_t pages;
+    zram_entry_t* table;
+    uint8_t* buffer;           // Compression output
+    void* workspace;           // LZ4 hash table
+    zram_stats_t stats;
+};
+
+zram_t* zram0 = NULL;
+
+zram_t* zram_create(uint32_t pages) {
+    zram_t* zram = (zram_t*)kcalloc(1, sizeof(zram_t));
+    if (!zram) return NULL;
+    zram->pages = pages;
+    zram->table = (zram_entry_t*)kcalloc(pages, sizeof(zram_entry_t));
+    zram->buffer = (uint8_t*)kmalloc(ZRAM_MAX_COMPRESSED);
+    zram->workspace = kmalloc(LZ4_WORKSPACE_SIZE);
+    if (!zram->table || !zram->buffer || !zram->workspace) {
+        zram_destroy(zram);
+        return NULL;
+    }
+    spinlock_init(&zram->lock);
+    return zram;
+}
+
+static void zram_free_entry(zram_t* zram, zram_entry_t* e) {
+    if (e->flags & ZRAM_ENTRY_ZERO) {
+        zram->stats.zero_pages--;
+    } else if (e->data) {
+        if (e->flags & ZRAM_ENTRY_RAW) zram->stats.raw_pages--;
+        zram->stats.compr_bytes -= e->len;
+        zram->stats.mem_used -= ksize(e->data);
+        kfree(e->data);
+    } else {
+        return;
+    }
+    zram->stats.pages_stored--;
+    e->data = NULL;
+    e->len = 0;
+    e->flags = 0;
+}
+
+void zram_destroy(zram_t* zram) {
+    if (!zram) return;
+    if (zram->table) {
+        for (uint32_t i = 0; i < zram->pages; i++) zram_free_entry(zram, &zram->table[i]);
+    }
+    kfree(zram->table);
+    kfree(zram->buffer);
+    kfree(zram->workspace);
+    kfree(zram);
+}
+
+static bool page_is_zero(const void* page) {
+    const uint64_t* p = (const uint64_t*)page;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) if (p[i]) return false;
+    return true;
+}
+
+int zram_write_page(zram_t* zram, uint32_t index, const void* src) {
+    if (index >= zram->pages) return -1;
+    unsigned long irq = spinlock_acquire_irqsave(&zram->lock);
+    zram_entry_t* e = &zram->table[index];
+    zram_free_entry(zram, e);
+    zram->stats.writes++;
+
+    if (page_is_zero(src)) {
+        e->flags = ZRAM_ENTRY_ZERO;
+        zram->stats.zero_pages++;
+        zram->stats.pages_stored++;
+        spinlock_release_irqrestore(&zram->lock, irq);
+        return 0;
+    }
+
+    uint64_t t0 = rdtsc();
+    int len = lz4_compress((const uint8_t*)src, PAGE_SIZE, zram->buffer, ZRAM_MAX_COMPRESSED, zram->workspace);
+    zram->stats.compress_cycles += rdtsc() - t0;
+    zram->stats.compress_bytes += PAGE_SIZE;
+
+    const void* data = zram->buffer;
+    uint8_t flags = 0;
+    if (len == 0) {
+        len = PAGE_SIZE;     // Incompressible: keep it raw
+        data = src;
+        flags = ZRAM_ENTRY_RAW;
+    }
+    e->data = kmalloc(len);
+    if (!e->data) {
+        spinlock_release_irqrestore(&zram->lock, irq);
+        return -1;
+    }
+    memcpy(e->data, data, len);
+    e->len = (uint16_t)len;
+    e->flags = flags;
+    if (flags & ZRAM_ENTRY_RAW) zram->stats.raw_pages++;
+    zram->stats.pages_stored++;
+    zram->stats.compr_bytes += len;
+    zram->stats.mem_used += ksize(e->data);
+    spinlock_release_irqrestore(&zram->lock, irq);
+    return 0;
+}
+
+int zram_read_page(zram_t* zram, uint32_t index, void* dst) {
+    if (index >= zram->pages) return -1;
+    unsigned long irq = spinlock_acquire_irqsave(&zram->lock);
+    zram_entry_t* e = &zram->table[index];
+    zram->stats.reads++;
+    int ret = 0;
+    if (!e->data) {
+        memset(dst, 0, PAGE_SIZE);   // Zero page or never written
+    } else if (e->flags & ZRAM_ENTRY_RAW) {
+        memcpy(dst, e->data, PAGE_SIZE);
+    } else {
+        uint64_t t0 = rdtsc();
+        if (lz4_decompress((const uint8_t*)e->data, e->len, (uint8_t*)dst, PAGE_SIZE) != PAGE_SIZE) ret = -1;
+        zram->stats.decompress_cycles += rdtsc() - t0;
+        zram->stats.decompress_bytes += PAGE_SIZE;
+    }
+    spinlock_release_irqrestore(&zram->lock, irq);
+    return ret;
+}
+
+// Drops a page's storage, e.g. when a swap slot is freed.
+void zram_discard_page(zram_t* zram, uint32_t index) {
+    if (index >= zram->pages) return;
+    unsigned long irq = spinlock_acquire_irqsave(&zram->lock);
+    zram_free_entry(zram, &zram->table[index]);
+    spinlock_release_irqrestore(&zram->lock, irq);
+}
+
+// Sector interface. Partial pages go through a bounce page.
+int zram_read_sectors(zram_t* zram, uint32_t sector, uint32_t count, void* buffer) {
+    uint8_t* page = (uint8_t*)kmalloc(PAGE_SIZE);
+    if (!page) return -1;
+    uint8_t* out = (uint8_t*)buffer;
+    int ret = 0;
+    while (count && ret == 0) {
+        uint32_t index = sector / (PAGE_SIZE / ZRAM_SECTOR_SIZE);
+        uint32_t first = sector % (PAGE_SIZE / ZRAM_SECTOR_SIZE);
+        uint32_t n = PAGE_SIZE / ZRAM_SECTOR_SIZE - first;
+        if (n > count) n = count;
+        ret = zram_read_page(zram, index, page);
+        memcpy(out, page + first * ZRAM_SECTOR_SIZE, n * ZRAM_SECTOR_SIZE);
+        out += n * ZRAM_SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    kfree(page);
+    return ret;
+}
+
+int zram_write_sectors(zram_t* zram, uint32_t sector, uint32_t count, const void* buffer) {
+    uint8_t* page = (uint8_t*)kmalloc(PAGE_SIZE);
+    if (!page) return -1;
+    const uint8_t* in = (const uint8_t*)buffer;
+    int ret = 0;
+    while (count && ret == 0) {
+        uint32_t index = sector / (PAGE_SIZE / ZRAM_SECTOR_SIZE);
+        uint32_t first = sector % (PAGE_SIZE / ZRAM_SECTOR_SIZE);
+        uint32_t n = PAGE_SIZE / ZRAM_SECTOR_SIZE - first;
+        if (n > count) n = count;
+        if (n < PAGE_SIZE / ZRAM_SECTOR_SIZE) ret = zram_read_page(zram, index, page);
+        memcpy(page + first * ZRAM_SECTOR_SIZE, in, n * ZRAM_SECTOR_SIZE);
+        if (ret == 0) ret = zram_write_page(zram, index, page);
+        in += n * ZRAM_SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    kfree(page);
+    return ret;
+}
+
+void zram_get_stats(zram_t* zram, zram_stats_t* stats) {
+    unsigned long irq = spinlock_acquire_irqsave(&zram->lock);
+    *stats = zram->stats;
+    spinlock_release_irqrestore(&zram->lock, irq);
+}
+
+void zram_stats_print(zram_t* zram) {
+    if (!zram) {
+        vga_print_string("zram: no device\n");
+        return;
+    }
+    zram_stats_t st;
+    zram_get_stats(zram, &st);
+    uint64_t orig = st.pages_stored * PAGE_SIZE;
+    vga_print_string("\nzram0: ");
+    vga_print_dec((uint32_t)st.pages_stored);
+    vga_print_string(" pages (");
+    vga_print_dec((uint32_t)st.zero_pages);
+    vga_print_string(" zero, ");
+    vga_print_dec((uint32_t)st.raw_pages);
+    vga_print_string(" raw)\norig ");
+    vga_print_dec((uint32_t)(orig / 1024));
+    vga_print_string(" KB  compressed ");
+    vga_print_dec((uint32_t)(st.compr_bytes / 1024));
+    vga_print_string(" KB  used ");
+    vga_print_dec((uint32_t)(st.mem_used / 1024));
+    vga_print_string(" KB  ratio x");
+    vga_print_dec(st.mem_used ? (uint32_t)(orig * 100 / st.mem_used) : 0);
+    vga_print_string("/100\ncompress ");
+    vga_print_dec(st.compress_cycles ? (uint32_t)(st.compress_bytes * 1000 / st.compress_cycles) : 0);
+    vga_print_string(" B/kcycle  decompress ");
+    vga_print_dec(st.decompress_cycles ? (uint32_t)(st.decompress_bytes * 1000 / st.decompress_cycles) : 0);
+    vga_print_string(" B/kcycle\nreads ");
+    vga_print_dec((uint32_t)st.reads);
+    vga_print_string("  writes ");
+    vga_print_dec((uint32_t)st.writes);
+    vga_print_string("\n");
+}
+
 // ==========================================
 // FILE: shell.c
 // ==========================================
@@ -2330,6 +6013,21 @@ static void shell_help(void) {
     vga_print_string("  help    - Show this help message\n");
     vga_print_string("  clear   - Clear the screen\n");
     vga_print_string("  about   - Show system information\n");
+    vga_print_string("  slabinfo - Show slab cache statistics\n");
+    vga_print_string("  zoneinfo - Show free pages per memory zone\n");
+    vga_print_string("  compact - Defragment physical memory\n");
+    vga_print_string("  zram    - Show compressed RAM device statistics\n");
+    vga_print_string("  membench - Measure memcpy/memset bytes per cycle\n");
+    vga_print_string("  ticks   - Show timer interrupt and tickless idle counts\n");
+    vga_print_string("  time    - Show uptime and wall-clock time\n");
+    vga_print_string("  cpus    - Show per-CPU run queues and IPI counts\n");
+    vga_print_string("  ctxbench - Measure context switch cost in cycles\n");
+    vga_print_string("  ps      - List tasks and spawn/reap counts\n");
+    vga_print_string("  syncstat - Show contention on registered mutexes and semaphores\n");
+    vga_print_string("  synctest - Contend a mutex and a semaphore across two tasks\n");
+#ifdef LOCKSTAT
+    vga_print_string("  lockstat - Show the most contended spinlocks ('lockstat reset' clears)\n");
+#endif
     vga_print_string("  reboot  - Reboot the system\n");
     vga_print_string("  halt    - Halt the system\n\n");
 }
@@ -2354,6 +6052,78 @@ static void shell_halt(void) {
     for(;;) { __asm__ __volatile__("hlt"); }
 }
 
+// Prints value/100 with two decimals
+static void shell_print_fixed2(uint64_t value) {
+    vga_print_dec((uint32_t)(value / 100));
+    vga_putchar('.');
+    if (value % 100 < 10) vga_putchar('0');
+    vga_print_dec((uint32_t)(value % 100));
+}
+
+static void shell_membench(void) {
+    size_t max_size = 8 * 1024 * 1024;
+    uint8_t* src = (uint8_t*)vmalloc(max_size);
+    uint8_t* dst = (uint8_t*)vmalloc(max_size);
+    if (!src || !dst) {
+        vga_print_string("membench: out of memory\n");
+        vfree(src);
+        vfree(dst);
+        return;
+    }
+    memset(src, 0x5A, max_size);
+    vga_print_string("\nimpl: ");
+    vga_print_string(string_impl_name());
+    vga_print_string("\nsize      memcpy B/cyc  memset B/cyc\n");
+    for (size_t size = 8; size <= max_size; size *= 8) {
+        // Move about 32 MB per measurement, at least once
+        size_t iters = (32 * 1024 * 1024) / size;
+        if (iters == 0) iters = 1;
+
+        uint64_t t0 = rdtsc();
+        for (size_t i = 0; i < iters; i++) memcpy(dst, src, size);
+        uint64_t t1 = rdtsc();
+        for (size_t i = 0; i < iters; i++) memset(dst, (int)i, size);
+        uint64_t t2 = rdtsc();
+
+        uint64_t bytes = (uint64_t)size * iters;
+        vga_print_dec((uint32_t)size);
+        vga_print_string("  ");
+        shell_print_fixed2(bytes * 100 / (t1 - t0 + 1));
+        vga_print_string("  ");
+        shell_print_fixed2(bytes * 100 / (t2 - t1 + 1));
+        vga_print_string("\n");
+    }
+    vfree(src);
+    vfree(dst);
+}
+
+static void shell_print_2digits(uint8_t v) {
+    if (v < 10) vga_putchar('0');
+    vga_print_dec(v);
+}
+
+static void shell_time(void) {
+    uint64_t ns = ktime_get_ns();
+    vga_print_string("\nUptime: ");
+    vga_print_dec((uint32_t)(ns / NSEC_PER_SEC));
+    vga_putchar('.');
+    uint32_t ms = (uint32_t)((ns / 1000000) % 1000);
+    if (ms < 100) vga_putchar('0');
+    if (ms < 10) vga_putchar('0');
+    vga_print_dec(ms);
+    vga_print_string(" s\nTime:   ");
+    uint8_t hour, minute, second;
+    rtc_get_time(&hour, &minute, &second);
+    shell_print_2digits(hour);
+    vga_putchar(':');
+    shell_print_2digits(minute);
+    vga_putchar(':');
+    shell_print_2digits(second);
+    vga_print_string(" UTC\nTSC:    ");
+    vga_print_dec(tsc_khz / 1000);
+    vga_print_string(" MHz\n");
+}
+
 static int shell_strcmp(const char *str1, const char *str2) {
     while (*str1 && (*str1 == *str2)) { str1++; str2++; }
     return *(unsigned char*)str1 - *(unsigned char*)str2;
@@ -2371,14 +6141,28 @@ static void shell_execute_command(void) {
     if (shell_strcmp(command_buffer, "help") == 0) shell_help();
     else if (shell_strcmp(command_buffer, "clear") == 0) shell_clear_screen();
     else if (shell_strcmp(command_buffer, "about") == 0) shell_about();
+    else if (shell_strcmp(command_buffer, "slabinfo") == 0) slabinfo_print();
+    else if (shell_strcmp(command_buffer, "zoneinfo") == 0) zoneinfo_print();
+    else if (shell_strcmp(command_buffer, "zram") == 0) zram_stats_print(zram0);
+    else if (shell_strcmp(command_buffer, "compact") == 0) {
+        vga_print_string("\nMigrated ");
+        vga_print_dec(compact_memory(-1));
+        vga_print_string(" pages\n");
+    }
+    else if (shell_strcmp(command_buffer, "membench") == 0) shell_membench();
+    else if (shell_strcmp(command_buffer, "ticks") == 0) tick_stats_print();
+    else if (shell_strcmp(command_buffer, "cpus") == 0) smp_print_cpus();
+    else if (shell_strcmp(command_buffer, "ctxbench") == 0) sched_bench();
+    else if (shell_strcmp(command_buffer, "ps") == 0) task_print_all();
+    else if (shell_strcmp(command_buffer, "syncstat") == 0) sync_stats_print();
+    else if (shell_strcmp(command_buffer, "synctest") == 0) sync_selftest();
+#ifdef LOCKSTAT
+    else if (shell_strcmp(command_buffer, "lockstat") == 0) lockstat_print();
+    else if (shell_strcmp(command_buffer, "lockstat reset") == 0) lockstat_reset();
+#endif
     else if (shell_strcmp(command_buffer, "reboot") == 0) shell_reboot();
     else if (shell_strcmp(command_buffer, "halt") == 0) shell_halt();
-    else if (shell_strcmp(command_buffer, "time") == 0){
-        uint32_t ticks = get_ticks()/500;
-        vga_print_string("Ticks: ");
-        vga_print_dec(ticks);
-        vga_print_string("Seconds\n");
-    }
+    else if (shell_strcmp(command_buffer, "time") == 0) shell_time();
     else {
         vga_print_string("\nUnknown command: ");
         vga_print_string(command_buffer);
@@ -2429,48 +6213,429 @@ void shell_init(void) {
     shell_print_prompt();
 }
 
+// ==========================================
+// FILE: wait.c
+// ==========================================
+// The caller holds the lock guarding the queue. Wakers set entry->woken and
+// wake the task with that lock held, so the entry (on the sleeper's stack)
+// is still valid while they touch it.
+
+void wait_queue_init(wait_queue_t* wq) {
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Sleeps at the tail of wq until woken. lock is held on entry, taken with
+// spinlock_acquire_irqsave (flags), and is held again on return; the new
+// flags are returned.
+unsigned long wait_queue_sleep(wait_queue_t* wq, spinlock_t* lock, unsigned long flags) {
+    task_t* self = get_current_task();
+    wait_entry_t entry = { self, NULL, false };
+    if (wq->tail) wq->tail->next = &entry;
+    else wq->head = &entry;
+    wq->tail = &entry;
+    do {
+        // Set before unlocking: a wake in between makes the task READY again
+        self->state = TASK_BLOCKED;
+        schedule_and_release_lock(lock, flags);
+        flags = spinlock_acquire_irqsave(lock);
+    } while (!entry.woken);
+    return flags;
+}
+
+// Wakes the longest waiter. Returns it, or NULL if the queue was empty.
+task_t* wait_queue_wake_one(wait_queue_t* wq) {
+    wait_entry_t* entry = wq->head;
+    if (!entry) return NULL;
+    wq->head = entry->next;
+    if (!wq->head) wq->tail = NULL;
+    task_t* task = entry->task;
+    entry->woken = true;
+    task_wake(task);
+    return task;
+}
+
+uint32_t wait_queue_wake_all(wait_queue_t* wq) {
+    uint32_t n = 0;
+    while (wait_queue_wake_one(wq)) n++;
+    return n;
+}
+
 // ==========================================
 // FILE: mutex.c
 // ==========================================
+// Adaptive mutex: a contended locker spins while the owner is running on
+// another CPU, since it will likely let go soon, and sleeps otherwise.
+// Unlock hands the mutex straight to the longest waiter, so waiters are
+// served FIFO and a spinner cannot overtake them.
+
+#define MUTEX_SPIN_MAX 100000   // pause iterations before giving up and sleeping
 
 void mutex_init(mutex_t* mutex) {
     if (mutex == NULL) return;
     spinlock_init(&mutex->lock);
     mutex->locked = false;
     mutex->owner = NULL;
-    mutex->wait_queue = NULL;
+    wait_queue_init(&mutex->waiters);
+    memset(&mutex->stats, 0, sizeof(mutex->stats));
+}
+
+// Spins without the lock while owner holds the mutex and is on a CPU.
+// Returns true once it looks free, false if spinning is not worth it.
+static bool mutex_spin_on_owner(mutex_t* mutex, task_t* owner) {
+    if (nr_cpus_online < 2 || !owner) return false;
+    for (uint32_t spins = 0; spins < MUTEX_SPIN_MAX; spins++) {
+        if (!mutex->locked) return true;
+        if (mutex->owner != owner || !owner->on_cpu) return false;
+        if (mutex->waiters.head) return false;   // It goes to them, not us
+        __asm__ volatile ("pause");
+    }
+    return false;
 }
 
 void mutex_lock(mutex_t* mutex) {
     if (mutex == NULL) return;
+    task_t* self = get_current_task();
     unsigned long flags = spinlock_acquire_irqsave(&mutex->lock);
-
-    task_t* current = get_current_task();
-    if (mutex->locked && mutex->owner != current) {
-        current->state = TASK_BLOCKED;
-        current->next = mutex->wait_queue;
-        mutex->wait_queue = current;
-        schedule_and_release_lock(&mutex->lock, flags);
-    } else {
+    if (!mutex->locked) {
         mutex->locked = true;
-        mutex->owner = current;
+        mutex->owner = self;
+        mutex->stats.acquisitions++;
         spinlock_release_irqrestore(&mutex->lock, flags);
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    bool slept = false;
+    mutex->stats.contended++;
+    for (;;) {
+        if (!mutex->locked) {
+            mutex->locked = true;
+            mutex->owner = self;
+            break;
+        }
+        if (!slept && !mutex->waiters.head) {
+            task_t* owner = mutex->owner;
+            spinlock_release_irqrestore(&mutex->lock, flags);
+            bool retry = mutex_spin_on_owner(mutex, owner);
+            flags = spinlock_acquire_irqsave(&mutex->lock);
+            if (retry) continue;
+        }
+        if (!mutex->locked) continue;
+        slept = true;
+        mutex->stats.sleeps++;
+        flags = wait_queue_sleep(&mutex->waiters, &mutex->lock, flags);
+        if (mutex->owner == self) break;   // Handed over by mutex_unlock
+    }
+    if (!slept) mutex->stats.spun++;
+    mutex->stats.acquisitions++;
+    mutex->stats.wait_cycles += rdtsc() - start;
+    spinlock_release_irqrestore(&mutex->lock, flags);
+}
+
+bool mutex_trylock(mutex_t* mutex) {
+    unsigned long flags = spinlock_acquire_irqsave(&mutex->lock);
+    bool acquired = !mutex->locked;
+    if (acquired) {
+        mutex->locked = true;
+        mutex->owner = get_current_task();
+        mutex->stats.acquisitions++;
     }
+    spinlock_release_irqrestore(&mutex->lock, flags);
+    return acquired;
 }
 
 void mutex_unlock(mutex_t* mutex) {
     if (mutex == NULL) return;
     unsigned long flags = spinlock_acquire_irqsave(&mutex->lock);
-    mutex->locked = false;
-    mutex->owner = NULL;
-    if (mutex->wait_queue != NULL) {
-        task_t* next_task = mutex->wait_queue;
-        mutex->wait_queue = next_task->next;
-        next_task->state = TASK_READY;
+    // Hand off: the mutex stays locked and the waiter owns it on return
+    task_t* next = wait_queue_wake_one(&mutex->waiters);
+    if (next) {
+        mutex->owner = next;
+    } else {
+        mutex->locked = false;
+        mutex->owner = NULL;
     }
     spinlock_release_irqrestore(&mutex->lock, flags);
 }
 
+// --- Counting semaphores ---
+// sem_up hands its unit directly to the longest waiter, as mutex_unlock does.
+
+void sem_init(semaphore_t* sem, int32_t count) {
+    spinlock_init(&sem->lock);
+    sem->count = count;
+    wait_queue_init(&sem->waiters);
+    memset(&sem->stats, 0, sizeof(sem->stats));
+}
+
+void sem_down(semaphore_t* sem) {
+    unsigned long flags = spinlock_acquire_irqsave(&sem->lock);
+    if (sem->count > 0) {
+        sem->count--;
+    } else {
+        uint64_t start = rdtsc();
+        sem->stats.contended++;
+        sem->stats.sleeps++;
+        flags = wait_queue_sleep(&sem->waiters, &sem->lock, flags);
+        sem->stats.wait_cycles += rdtsc() - start;
+    }
+    sem->stats.acquisitions++;
+    spinlock_release_irqrestore(&sem->lock, flags);
+}
+
+bool sem_trydown(semaphore_t* sem) {
+    unsigned long flags = spinlock_acquire_irqsave(&sem->lock);
+    bool acquired = sem->count > 0;
+    if (acquired) {
+        sem->count--;
+        sem->stats.acquisitions++;
+    }
+    spinlock_release_irqrestore(&sem->lock, flags);
+    return acquired;
+}
+
+// Safe from interrupt handlers.
+void sem_up(semaphore_t* sem) {
+    unsigned long flags = spinlock_acquire_irqsave(&sem->lock);
+    if (!wait_queue_wake_one(&sem->waiters)) sem->count++;
+    spinlock_release_irqrestore(&sem->lock, flags);
+}
+
+// --- Condition variables ---
+
+void cond_init(condvar_t* cv) {
+    spinlock_init(&cv->lock);
+    wait_queue_init(&cv->waiters);
+    memset(&cv->stats, 0, sizeof(cv->stats));
+}
+
+// Releases mutex and sleeps until signalled, then takes mutex again.
+// Queueing before the unlock means a signal sent after it is not lost.
+// Callers re-check their condition in a loop, as usual.
+void cond_wait(condvar_t* cv, mutex_t* mutex) {
+    unsigned long flags = spinlock_acquire_irqsave(&cv->lock);
+    uint64_t start = rdtsc();
+    cv->stats.sleeps++;
+    mutex_unlock(mutex);
+    flags = wait_queue_sleep(&cv->waiters, &cv->lock, flags);
+    cv->stats.acquisitions++;
+    cv->stats.wait_cycles += rdtsc() - start;
+    spinlock_release_irqrestore(&cv->lock, flags);
+    mutex_lock(mutex);
+}
+
+void cond_signal(condvar_t* cv) {
+    unsigned long flags = spinlock_acquire_irqsave(&cv->lock);
+    wait_queue_wake_one(&cv->waiters);
+    spinlock_release_irqrestore(&cv->lock, flags);
+}
+
+void cond_broadcast(condvar_t* cv) {
+    unsigned long flags = spinlock_acquire_irqsave(&cv->lock);
+    wait_queue_wake_all(&cv->waiters);
+    spinlock_release_irqrestore(&cv->lock, flags);
+}
+
+// --- Contention report ---
+// Sleeping locks worth watching register their counters here; the syncstat
+// shell command lists them.
+#define SYNC_STATS_MAX 16
+
+static struct {
+    const char* name;
+    lock_contention_t* stats;
+} sync_stats[SYNC_STATS_MAX];
+static uint32_t nr_sync_stats = 0;
+static spinlock_t sync_stats_lock;   // Zero is unlocked, so usable before init
+
+void sync_stats_register(const char* name, lock_contention_t* stats) {
+    unsigned long irq = spinlock_acquire_irqsave(&sync_stats_lock);
+    bool known = false;
+    for (uint32_t i = 0; i < nr_sync_stats && !known; i++) known = sync_stats[i].stats == stats;
+    if (!known && nr_sync_stats < SYNC_STATS_MAX) {
+        sync_stats[nr_sync_stats].name = name;
+        sync_stats[nr_sync_stats].stats = stats;
+        nr_sync_stats++;
+    }
+    spinlock_release_irqrestore(&sync_stats_lock, irq);
+}
+
+void sync_stats_print(void) {
+    vga_print_string("\nlock: acquired contended spun slept | avg wait (cycles)\n");
+    if (nr_sync_stats == 0) vga_print_string("(none registered; run synctest)\n");
+    for (uint32_t i = 0; i < nr_sync_stats; i++) {
+        lock_contention_t* st = sync_stats[i].stats;
+        vga_print_string(sync_stats[i].name);
+        vga_print_string(": ");
+        vga_print_dec((uint32_t)st->acquisitions);
+        vga_print_string(" ");
+        vga_print_dec((uint32_t)st->contended);
+        vga_print_string(" ");
+        vga_print_dec((uint32_t)st->spun);
+        vga_print_string(" ");
+        vga_print_dec((uint32_t)st->sleeps);
+        vga_print_string(" | ");
+        uint64_t avg = st->contended ? st->wait_cycles / st->contended : 0;
+        vga_print_dec(avg > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)avg);
+        vga_print_string("\n");
+    }
+}
+
+// --- Self-test ---
+// Two workers update shared counters under a mutex and a binary semaphore,
+// yielding inside each critical section so the other one runs into it.
+// The driver waits for both on a condition variable and checks the totals.
+#define SYNC_TEST_ROUNDS 200
+
+static mutex_t synctest_mutex;
+static semaphore_t synctest_sem;
+static condvar_t synctest_done_cv;
+static uint32_t synctest_mutex_count, synctest_sem_count, synctest_done;
+static volatile bool synctest_running = false;
+
+static void synctest_worker(void) {
+    for (int i = 0; i < SYNC_TEST_ROUNDS; i++) {
+        mutex_lock(&synctest_mutex);
+        uint32_t v = synctest_mutex_count;
+        schedule_from_yield();
+        synctest_mutex_count = v + 1;
+        mutex_unlock(&synctest_mutex);
+
+        sem_down(&synctest_sem);
+        v = synctest_sem_count;
+        schedule_from_yield();
+        synctest_sem_count = v + 1;
+        sem_up(&synctest_sem);
+    }
+    mutex_lock(&synctest_mutex);
+    synctest_done++;
+    cond_signal(&synctest_done_cv);
+    mutex_unlock(&synctest_mutex);
+}
+
+static void synctest_task(void) {
+    mutex_init(&synctest_mutex);
+    sem_init(&synctest_sem, 1);
+    cond_init(&synctest_done_cv);
+    sync_stats_register("synctest mutex", &synctest_mutex.stats);
+    sync_stats_register("synctest sem", &synctest_sem.stats);
+    sync_stats_register("synctest cond", &synctest_done_cv.stats);
+    synctest_mutex_count = synctest_sem_count = synctest_done = 0;
+
+    // Unpinned, so on SMP the mutex's spin-on-owner path gets exercised too
+    uint32_t workers = 0;
+    if (task_spawn("synctest-a", synctest_worker, &kernel_address_space, PRIO_DEFAULT, -1)) workers++;
+    if (task_spawn("synctest-b", synctest_worker, &kernel_address_space, PRIO_DEFAULT, -1)) workers++;
+    mutex_lock(&synctest_mutex);
+    while (synctest_done < workers) cond_wait(&synctest_done_cv, &synctest_mutex);
+    mutex_unlock(&synctest_mutex);
+
+    bool ok = workers == 2 && synctest_mutex_count == 2 * SYNC_TEST_ROUNDS &&
+              synctest_sem_count == 2 * SYNC_TEST_ROUNDS;
+    vga_print_string(ok ? "\nsynctest: passed\n" : "\nsynctest: FAILED\n");
+    vga_print_string("mutex count ");
+    vga_print_dec(synctest_mutex_count);
+    vga_print_string(", semaphore count ");
+    vga_print_dec(synctest_sem_count);
+    vga_print_string(" (expected ");
+    vga_print_dec(2 * SYNC_TEST_ROUNDS);
+    vga_print_string(")");
+    sync_stats_print();
+    synctest_running = false;
+}
+
+// Runs the self-test in its own task; prints when done.
+void sync_selftest(void) {
+    if (__atomic_exchange_n(&synctest_running, true, __ATOMIC_ACQUIRE)) {
+        vga_print_string("\nsynctest already running\n");
+        return;
+    }
+    if (!task_spawn("synctest", synctest_task, &kernel_address_space, PRIO_DEFAULT, -1)) {
+        vga_print_string("\nsynctest: out of memory\n");
+        synctest_running = false;
+    }
+}
+
+// ==========================================
+// FILE: lockstat.c
+// ==========================================
+#ifdef LOCKSTAT
+#define LOCKSTAT_CLASSES 64
+#define LOCKSTAT_TOP     10
+
+static lock_class_t lock_classes[LOCKSTAT_CLASSES];
+static uint32_t nr_lock_classes = 0;
+static spinlock_t lock_class_lock;   // Never initialised, so not itself tracked
+
+// Finds or registers the class for a spinlock_init() expression. Returns
+// NULL once the table is full; those locks simply go untracked.
+lock_class_t* lockstat_class(const char* name) {
+    if (name[0] == '&') name++;
+    unsigned long irq = spinlock_acquire_irqsave(&lock_class_lock);
+    lock_class_t* c = NULL;
+    for (uint32_t i = 0; i < nr_lock_classes && !c; i++) {
+        if (strcmp(lock_classes[i].name, name) == 0) c = &lock_classes[i];
+    }
+    if (!c && nr_lock_classes < LOCKSTAT_CLASSES) {
+        c = &lock_classes[nr_lock_classes++];
+        c->name = name;
+    }
+    spinlock_release_irqrestore(&lock_class_lock, irq);
+    return c;
+}
+
+void lockstat_reset(void) {
+    for (uint32_t i = 0; i < nr_lock_classes; i++) {
+        const char* name = lock_classes[i].name;
+        memset(&lock_classes[i], 0, sizeof(lock_class_t));
+        lock_classes[i].name = name;
+    }
+}
+
+static void lockstat_print_cycles(uint64_t cycles) {
+    // Wide enough for the table; clamps instead of wrapping
+    vga_print_dec(cycles > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)cycles);
+    vga_print_string(" ");
+}
+
+// Lists the most contended classes, most contended first.
+void lockstat_print(void) {
+    uint32_t order[LOCKSTAT_CLASSES];
+    uint32_t n = nr_lock_classes;
+    for (uint32_t i = 0; i < n; i++) order[i] = i;
+    // Selection sort on contentions; the table is tiny
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = i + 1; j < n; j++) {
+            if (lock_classes[order[j]].contended > lock_classes[order[i]].contended) {
+                uint32_t t = order[i];
+                order[i] = order[j];
+                order[j] = t;
+            }
+        }
+    }
+    vga_print_string("\nlock: acquired contended | wait avg max | hold avg max (cycles)\n");
+    uint32_t shown = 0;
+    for (uint32_t i = 0; i < n && shown < LOCKSTAT_TOP; i++) {
+        lock_class_t* c = &lock_classes[order[i]];
+        if (!c->acquisitions) continue;   // Registered but never taken
+        shown++;
+        vga_print_string(c->name);
+        vga_print_string(": ");
+        vga_print_dec((uint32_t)c->acquisitions);
+        vga_print_string(" ");
+        vga_print_dec((uint32_t)c->contended);
+        vga_print_string(" | ");
+        lockstat_print_cycles(c->contended ? c->wait_cycles / c->contended : 0);
+        lockstat_print_cycles(c->max_wait);
+        vga_print_string("| ");
+        lockstat_print_cycles(c->hold_cycles / c->acquisitions);
+        lockstat_print_cycles(c->max_hold);
+        vga_print_string("\n");
+    }
+}
+#endif
+
 // ==========================================
 // FILE: main kernel.c
 // ==========================================
@@ -2511,12 +6676,15 @@ void sleep_test_task() {
 
 void kernel_main(struct boot_params* params) __asm__("kernel_main");
 void kernel_main(struct boot_params* params) {
+    string_init(); // Pick memcpy/memset variants before anything copies
     gdt_install();
     idt_install();
     mm_init(params); // Initialize new Memory Manager
+    slab_init();
+    memcpy(&screen_info, &params->screen_info, sizeof(struct screen_info)); // paging_install maps the framebuffer
     paging_install();
-    heap_init(0x00400000, 16 * 1024 * 1024); // 16 MB heap at 4 MB
-    memcpy(&screen_info, &params->screen_info, sizeof(struct screen_info));
+    heap_init(); // Pools come from the buddy allocator on demand
+    zram0 = zram_create(ZRAM0_PAGES);
     FrameBuffer fb;
     fb.address=(void*)(uintptr_t)screen_info.physbase;
     fb.width=screen_info.resolution_x;
@@ -2537,12 +6705,17 @@ void kernel_main(struct boot_params* params) {
     
     syscalls_install();
     timer_install();
+    clock_init();
     keyboard_install();
     __asm__ __volatile__("sti");
     rtl8139_init();
     tasking_install();
+    fpu_init();
     mouse_install();
-    create_task("counter", counter_task);
+    create_idle_task(idle_task_func);
+    create_task_prio("kmemd", kmemd_task, PRIO_DEFAULT);
+    smp_init();
+    create_task_prio("counter", counter_task, PRIO_BATCH);
     create_task("sleeper", sleep_test_task);
     cursor_init();
 
@@ -2640,6 +6813,8 @@ void kernel_main(struct boot_params* params) {
 
         cursor_update(&fb, mouse_x, mouse_y);
         swap_buffers(&fb);
-        __asm__ __volatile__("hlt");
+        // Block until input arrives so lower-priority tasks get the CPU; the
+        // timeout only bounds redraw latency for non-input changes
+        input_wait(50);
     }
 } 
\ No newline at end of file
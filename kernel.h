@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include "lz4.h"
+#include "memops.h"
 
 // ==========================================
 // 1. IO.H (Hardware Port I/O)
@@ -33,6 +35,29 @@ static inline uint32_t inl(uint16_t port) {
     __asm__ volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
     return ret;
 }
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+#define MSR_APIC_BASE 0x1B
+#define MSR_GS_BASE   0xC0000101
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// lib.c: memset/memcpy/memmove variants selected from CPUID at boot
+void string_init(void);
+const char* string_impl_name(void);
+void clear_page_nt(void* page);
 
 // ==========================================
 // 2. GRAPHICS.H (VBE & Framebuffer)
@@ -86,22 +111,124 @@ void swap_buffers(FrameBuffer* fb);
 // ==========================================
 // 3. SYNC.H (Spinlocks)
 // ==========================================
+// Per-class spinlock statistics, listed by the lockstat shell command.
+// Off by default: every acquisition of a tracked lock updates its class's
+// shared counters, which bounces their cache line between CPUs. Build with
+// `make LOCKSTAT=1` to enable.
+
+// Locks initialised from the same expression (e.g. every &cache->lock)
+// share a class and are counted together.
+typedef struct lock_class {
+    const char* name;
+    uint64_t acquisitions;
+    uint64_t contended;      // Had to wait for another holder
+    uint64_t wait_cycles;    // TSC cycles spent waiting
+    uint64_t max_wait;
+    uint64_t hold_cycles;    // TSC cycles held
+    uint64_t max_hold;
+} lock_class_t;
+
+// Ticket lock: an acquirer takes the next ticket and spins reading head
+// until its number comes up. Waiters are served in arrival order, and only
+// the release writes the line they spin on. All zeroes is unlocked.
 typedef struct {
-    volatile int locked;
+    union {
+        volatile uint32_t ticket;
+        struct {
+            volatile uint16_t head;   // Ticket being served
+            volatile uint16_t tail;   // Next ticket to hand out
+        };
+    };
+#ifdef LOCKSTAT
+    lock_class_t* lock_class;         // NULL: not tracked
+    uint64_t acquired_at;             // TSC when the holder got it, 0 if unknown
+#endif
 } spinlock_t;
 
-static inline void spinlock_init(spinlock_t* lock) {
-    lock->locked = 0;
+#ifdef LOCKSTAT
+lock_class_t* lockstat_class(const char* name);
+void lockstat_print(void);
+void lockstat_reset(void);
+
+static inline void lockstat_acquired(spinlock_t* lock, uint64_t wait_start) {
+    lock_class_t* c = lock->lock_class;
+    if (!c) return;
+    uint64_t now = rdtsc();
+    __atomic_fetch_add(&c->acquisitions, 1, __ATOMIC_RELAXED);
+    if (wait_start) {
+        uint64_t wait = now - wait_start;
+        __atomic_fetch_add(&c->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&c->wait_cycles, wait, __ATOMIC_RELAXED);
+        if (wait > c->max_wait) c->max_wait = wait;   // Racy, but only ever grows
+    }
+    lock->acquired_at = now;
 }
 
+static inline void lockstat_released(spinlock_t* lock) {
+    lock_class_t* c = lock->lock_class;
+    if (!c || !lock->acquired_at) return;
+    uint64_t held = rdtsc() - lock->acquired_at;
+    lock->acquired_at = 0;
+    __atomic_fetch_add(&c->hold_cycles, held, __ATOMIC_RELAXED);
+    if (held > c->max_hold) c->max_hold = held;
+}
+#endif
+
+static inline void spinlock_init_class(spinlock_t* lock, const char* name) {
+    lock->ticket = 0;
+#ifdef LOCKSTAT
+    lock->lock_class = lockstat_class(name);
+    lock->acquired_at = 0;
+#else
+    (void)name;
+#endif
+}
+#define spinlock_init(lock) spinlock_init_class((lock), #lock)
+
 static inline void spinlock_acquire(spinlock_t* lock) {
-    while (__sync_lock_test_and_set(&lock->locked, 1)) {
-        while (lock->locked) { __asm__ volatile ("pause"); }
+    uint16_t ticket = __atomic_fetch_add(&lock->tail, 1, __ATOMIC_ACQUIRE);
+    uint64_t wait_start = 0;
+    if (__atomic_load_n(&lock->head, __ATOMIC_ACQUIRE) != ticket) {
+#ifdef LOCKSTAT
+        if (lock->lock_class) wait_start = rdtsc();
+#endif
+        while (__atomic_load_n(&lock->head, __ATOMIC_ACQUIRE) != ticket) { __asm__ volatile ("pause"); }
     }
+#ifdef LOCKSTAT
+    lockstat_acquired(lock, wait_start);
+#else
+    (void)wait_start;
+#endif
+}
+
+// Takes the lock only if nobody holds or is waiting for it.
+static inline bool spinlock_trylock(spinlock_t* lock) {
+    uint32_t old = lock->ticket;
+    if ((uint16_t)old != (uint16_t)(old >> 16)) return false;
+    if (!__atomic_compare_exchange_n(&lock->ticket, &old, old + 0x10000, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+#ifdef LOCKSTAT
+    lockstat_acquired(lock, 0);
+#endif
+    return true;
 }
 
 static inline void spinlock_release(spinlock_t* lock) {
-    __sync_lock_release(&lock->locked);
+#ifdef LOCKSTAT
+    lockstat_released(lock);
+#endif
+    // Only the holder writes head
+    __atomic_store_n(&lock->head, (uint16_t)(lock->head + 1), __ATOMIC_RELEASE);
+}
+
+static inline unsigned long local_irq_save(void) {
+    unsigned long flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void local_irq_restore(unsigned long flags) {
+    __asm__ volatile ("pushq %0; popfq" : : "r"(flags) : "memory", "cc");
 }
 
 static inline unsigned long spinlock_acquire_irqsave(spinlock_t* lock) {
@@ -116,6 +243,83 @@ static inline void spinlock_release_irqrestore(spinlock_t* lock, unsigned long f
     __asm__ volatile ("pushq %0; popfq" : : "r"(flags));
 }
 
+// Seqlock: writers bump the sequence around updates, readers retry if it
+// was odd or changed. Readers never block the writer (e.g. the timer IRQ).
+typedef struct {
+    volatile uint32_t sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+static inline void seqlock_init(seqlock_t* sl) {
+    sl->sequence = 0;
+    spinlock_init(&sl->lock);
+}
+
+static inline void write_seqlock(seqlock_t* sl) {
+    spinlock_acquire(&sl->lock);
+    sl->sequence++;
+    __asm__ volatile ("" ::: "memory");
+}
+
+static inline void write_sequnlock(seqlock_t* sl) {
+    __asm__ volatile ("" ::: "memory");
+    sl->sequence++;
+    spinlock_release(&sl->lock);
+}
+
+static inline uint32_t read_seqbegin(const seqlock_t* sl) {
+    uint32_t seq;
+    while ((seq = sl->sequence) & 1) { __asm__ volatile ("pause"); }
+    __asm__ volatile ("" ::: "memory");
+    return seq;
+}
+
+static inline bool read_seqretry(const seqlock_t* sl, uint32_t seq) {
+    __asm__ volatile ("" ::: "memory");
+    return sl->sequence != seq;
+}
+
+#define MAX_CPUS 8
+
+// Per-CPU data, reached through the GS base. The first field points back
+// at the structure so this_cpu() is a single load.
+struct task;
+struct address_space;
+typedef struct cpu {
+    struct cpu* self;
+    uint32_t id;                        // Logical index into cpus[]
+    uint32_t apic_id;
+    volatile bool online;
+    volatile bool need_resched;
+    volatile bool tlb_flush_pending;    // TLB shootdown requested by another CPU
+    volatile bool tick_stopped;         // Idle with the periodic tick stopped (nohz)
+    struct task* current;
+    struct task* idle;                  // Runs when the CPU's run queues are empty
+    struct task* switched_out;          // Task being switched away from, see finish_switch()
+    struct address_space* active_as;
+    struct task* fpu_owner;             // Task whose FPU state the registers hold
+    bool fpu_active;                    // CR0.TS clear: current has the FPU loaded
+    unsigned long fpu_irq_flags;        // Saved by kernel_fpu_begin()
+    uint64_t nr_switches;
+    uint64_t nr_ipis;
+    uint64_t nr_fpu_traps;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t nr_cpus_online;
+
+static inline cpu_t* this_cpu(void) {
+    cpu_t* cpu;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t smp_processor_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(cpu_t, id)));
+    return id;
+}
+
 // ==========================================
 // 4. VGA.H (Text Mode)
 // ==========================================
@@ -174,9 +378,24 @@ struct gdt_ptr {
     uint64_t base;
 } __attribute__((packed));
 
-void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
+struct tss_entry {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+#define IST_PAGE_FAULT   1
+#define IST_DOUBLE_FAULT 2
+
+void gdt_set_gate(struct gdt_entry* table, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
 void gdt_install(void);
-void gdt_flush(void);
+void gdt_install_cpu(uint32_t cpu);
+void gdt_flush(struct gdt_ptr* ptr);
+void tss_install(uint32_t cpu);
 
 struct idt_entry {
     uint16_t base_lo;
@@ -193,15 +412,17 @@ struct idt_ptr {
     uint64_t base;
 } __attribute__((packed));
 
+// Trap frame, lowest address first: the stubs push r15 first and rax last
 typedef struct {
-    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
-    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t rax, rbx, rcx, rdx, rsi, rdi, rbp;
+    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
     uint64_t int_no, err_code;
     uint64_t rip, cs, rflags, rsp, ss;
 } registers_t;
 
 typedef registers_t* (*isr_t)(registers_t*);
 void idt_install(void);
+void idt_load(void);
 void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags);
 registers_t* irq_handler(registers_t *r);
 registers_t* isr_handler(registers_t *r);
@@ -238,52 +459,129 @@ typedef struct page_frame {
     page_state_t state;
 } page_frame_t;
 
+// Physical zones, lowest first. An allocation limited to a zone may also
+// be served from any zone below it.
+typedef enum { ZONE_DMA, ZONE_DMA32, ZONE_NORMAL, MAX_NR_ZONES } zone_type_t;
+
 void pmm_init(uint32_t memory_end);
 void* pmm_alloc_page(void);
 void* pmm_alloc_pages(uint32_t count);
+void* pmm_alloc_pages_zone(uint32_t count, zone_type_t highest);
 void pmm_free_page(void* p);
 uint32_t pmm_get_free_memory(void);
+void* alloc_zeroed_page(void);
+bool zero_pool_refill(void);
+uint32_t zero_pool_drain(void);
+void zoneinfo_print(void);
+void pmm_mark_movable(void* frame, uintptr_t virt);
+uint32_t compact_memory(int order);
+void kmemd_task(void);
 
 // ==========================================
 // 8. HEAP.H (Kernel Heap)
 // ==========================================
-void heap_init(uintptr_t start_address, uint32_t size);
+void heap_init(void);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
+void* kmalloc_aligned(size_t size, size_t alignment);
+void* kcalloc(size_t count, size_t size);
+void* krealloc(void* ptr, size_t size);
+size_t ksize(void* ptr);
 
 // ==========================================
 // 9. PAGING.H (Virtual Memory)
 // ==========================================
-typedef struct page {
-    uint32_t present    : 1;
-    uint32_t rw         : 1;
-    uint32_t user       : 1;
-    uint32_t accessed   : 1;
-    uint32_t dirty      : 1;
-    uint32_t unused     : 7;
-    uint32_t frame      : 20;
-} page_t;
-
-typedef struct page_table {
-    page_t pages[1024];
-} page_table_t;
-
-typedef struct page_directory {
-    page_table_t *tables[1024];
-    uint32_t physical_tables[1024];
-    uint32_t physicalAddr;
-} page_directory_t;
+#define TLB_FLUSH_THRESHOLD 33   // Past this many pages a CR3 reload beats invlpg
+
+typedef struct {
+    uint64_t pages[TLB_FLUSH_THRESHOLD];
+    uint32_t count;
+} tlb_batch_t;
+
+typedef enum { PAGING_MAP, PAGING_UNMAP, PAGING_PROTECT } paging_op_t;
 
 void paging_install(void);
+void paging_init_cpu(void);
+void tlb_flush_local(void);
 void paging_map(uint64_t phys, uint64_t virt, uint64_t flags);
-void switch_page_directory(page_directory_t *dir);
-extern page_directory_t* page_directory;
+void paging_unmap(uint64_t virt);
+void paging_map_range(uint64_t phys, uint64_t virt, uint64_t size, uint64_t flags);
+void paging_unmap_range(uint64_t virt, uint64_t size);
+void paging_protect_range(uint64_t virt, uint64_t size, uint64_t flags);
+bool direct_mapped(uint64_t phys, uint64_t size);
+void tlb_batch_add(tlb_batch_t* batch, uint64_t virt);
+void tlb_batch_flush(tlb_batch_t* batch);
+
+// vmalloc window: virtually contiguous, physically scattered allocations
+#define VMALLOC_START    0xFFFFFE0000000000ULL
+#define VMALLOC_END      0xFFFFFF0000000000ULL
+
+typedef struct vm_area {
+    uintptr_t start;
+    uintptr_t end;
+    const char* name;
+    struct vm_area* next;
+} vm_area_t;
+
+void vma_release(void* addr);
+void* vmalloc(size_t size);
+void* vmalloc_stack(size_t size);
+void vfree(void* addr);
+
+// Per-task address spaces: the direct map and upper half are shared,
+// USER_SPACE_START..USER_SPACE_END is private to each space.
+#define USER_SPACE_START 0x0000008000000000ULL
+#define USER_SPACE_END   0x0000800000000000ULL
+
+typedef struct address_space {
+    uint64_t* pml4;         // Direct-mapped, so also the CR3 value
+    uint16_t pcid;          // TLB tag; 0 when PCID is unavailable
+    volatile uint32_t tlb_stale;  // CPUs whose TLB may hold old private entries
+    uint32_t refcount;
+} address_space_t;
+
+extern address_space_t kernel_address_space;
+address_space_t* as_create(void);
+address_space_t* as_get(address_space_t* as);
+void as_put(address_space_t* as);
+void as_switch(address_space_t* as);
+void as_map_range(address_space_t* as, uint64_t phys, uint64_t virt, uint64_t size, uint64_t flags);
+void as_unmap_range(address_space_t* as, uint64_t virt, uint64_t size);
 
 // ==========================================
 // 10. TIMER.H
 // ==========================================
 void timer_install(void);
 uint32_t get_ticks();
+void tick_nohz_idle_enter(void);
+void tick_nohz_irq_enter(registers_t* r);
+void tick_stats_print(void);
+extern bool nohz_enabled;
+
+// Clock: TSC calibrated against PIT channel 2, monotonic since boot
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_TICK 10000000ULL    // 100 Hz
+void clock_init(void);
+uint64_t ktime_get_ns(void);
+uint64_t ktime_get_real_ns(void);    // Unix time, synced from the CMOS RTC
+void ndelay(uint64_t ns);            // Busy-wait
+void nsleep(uint64_t ns);
+void usleep(uint64_t us);
+extern uint32_t tsc_khz;
+extern bool tsc_invariant;
+
+// Kernel timers: callbacks run from the timer interrupt at their deadline
+typedef struct ktimer {
+    struct ktimer* next;
+    struct ktimer** pprev;      // NULL when not pending
+    uint32_t expires;           // Absolute tick
+    void (*callback)(void* data);
+    void* data;
+} ktimer_t;
+
+void timer_setup(ktimer_t* t, void (*callback)(void*), void* data);
+void timer_add(ktimer_t* t, uint32_t deadline);
+bool timer_cancel(ktimer_t* t);
 
 // ==========================================
 // 11. KEYBOARD.H & MOUSE.H
@@ -456,6 +754,7 @@ void window_free(Window* window);
 void console_init(FrameBuffer* fb, Font* font);
 void console_write(const char* str);
 void console_write_dec(uint32_t n);
+void console_write_hex(uint64_t n);
 
 void shell_init(void);
 void shell_handle_input(char ch);
@@ -474,17 +773,51 @@ typedef enum {
 
 typedef struct task {
     int id;                 
-    registers_t regs;       
+    uint64_t rsp;            // Saved by switch_to; the trap frame is on this stack
+    void (*entry)(void);
+    const char* name;
     void* kernel_stack;    
     task_state_t state;
-    uint64_t wake_at_tick;
-    struct task* next;       
+    ktimer_t sleep_timer;
+    address_space_t* as;
+    int priority;            // 0 (highest) .. SCHED_PRIORITIES-1
+    uint32_t time_slice;     // Ticks left before round-robin within the priority
+    struct task* run_next;   // Run queue link, or zombie list link once exited
+    struct task* next;       // All tasks, circular
+    uint32_t cpu;            // Run queue the task belongs to
+    bool pinned;             // Never stolen by another CPU
+    volatile bool on_cpu;    // Context not yet saved; must not run elsewhere
+    void* fpu_state;         // FXSAVE/XSAVE area, allocated on first FPU use
+    uint32_t fpu_cpu;        // CPU whose registers last held fpu_state
 } task_t;
 
+#define TASK_STACK_SIZE (64 * 1024)
+
+#define SCHED_PRIORITIES 64     // One bit each in the ready bitmap
+#define PRIO_INTERACTIVE 8
+#define PRIO_DEFAULT     32
+#define PRIO_BATCH       48
+#define PRIO_IDLE        63
+
 void tasking_install(void);
-void create_task(char* name, void (*entry_point)(void));
-registers_t* schedule(registers_t* r);
+void create_task(const char* name, void (*entry_point)(void));
+void create_task_in(const char* name, void (*entry_point)(void), address_space_t* as);
+void create_task_prio(const char* name, void (*entry_point)(void), int priority);
+void create_idle_task(void (*entry_point)(void));
+void sched_init_cpu(void);
+uint32_t sched_nr_running(uint32_t cpu);
+void task_exit(void);
+void task_print_all(void);
+void task_wake(struct task* task);
+void scheduler_tick(void);
+void schedule_irq_exit(void);
+void input_wait(uint32_t ms);
+void input_notify(void);
+void schedule(void);
+void schedule_from_yield(void);
 void schedule_and_release_lock(spinlock_t* lock, unsigned long flags);
+void switch_to(uint64_t* prev_rsp, uint64_t next_rsp);
+void sched_bench(void);
 task_t* get_current_task(void);
 void sleep(uint32_t ms);
 
@@ -495,6 +828,33 @@ void ata_init(void);
 void ata_read_sector(uint32_t lba, uint8_t* buffer);
 void ata_write_sector(uint32_t lba, uint8_t* buffer);
 
+
+// zram: compressed in-memory block device addressed by page or 512-byte sector
+#define ZRAM0_PAGES 4096   // 16 MB scratch device created at boot
+
+typedef struct {
+    uint64_t pages_stored;     // Including zero pages
+    uint64_t zero_pages;       // Deduplicated, no storage
+    uint64_t raw_pages;        // Did not compress below the size limit
+    uint64_t compr_bytes;      // Sum of stored lengths
+    uint64_t mem_used;         // Allocator footprint of the stored data
+    uint64_t reads, writes;
+    uint64_t compress_bytes, compress_cycles;
+    uint64_t decompress_bytes, decompress_cycles;
+} zram_stats_t;
+
+typedef struct zram zram_t;
+extern zram_t* zram0;
+zram_t* zram_create(uint32_t pages);
+void zram_destroy(zram_t* zram);
+int zram_write_page(zram_t* zram, uint32_t index, const void* src);
+int zram_read_page(zram_t* zram, uint32_t index, void* dst);
+void zram_discard_page(zram_t* zram, uint32_t index);
+int zram_read_sectors(zram_t* zram, uint32_t sector, uint32_t count, void* buffer);
+int zram_write_sectors(zram_t* zram, uint32_t sector, uint32_t count, const void* buffer);
+void zram_get_stats(zram_t* zram, zram_stats_t* stats);
+void zram_stats_print(zram_t* zram);
+
 typedef struct {
     char name[128];
     uint32_t size;
@@ -519,20 +879,78 @@ void audio_stop(void);
 extern FrameBuffer* console_fb;
 extern Font* console_font;
 // ==========================================
-// 21. MUTEX.H
+// 21. WAIT.H & MUTEX.H (Sleeping locks)
 // ==========================================
 struct task;
+
+// Wait queue entry. Lives on the sleeping task's stack, so waiting needs
+// no allocation and does not touch the task's run-queue link.
+typedef struct wait_entry {
+    struct task* task;
+    struct wait_entry* next;
+    bool woken;
+} wait_entry_t;
+
+// FIFO of sleeping tasks, protected by the lock of the object that owns it
+typedef struct {
+    wait_entry_t* head;
+    wait_entry_t* tail;
+} wait_queue_t;
+
+void wait_queue_init(wait_queue_t* wq);
+unsigned long wait_queue_sleep(wait_queue_t* wq, spinlock_t* lock, unsigned long flags);
+struct task* wait_queue_wake_one(wait_queue_t* wq);
+uint32_t wait_queue_wake_all(wait_queue_t* wq);
+
+// Contention counters kept by every sleeping lock
+typedef struct {
+    uint64_t acquisitions;   // Completed lock / down / wait calls
+    uint64_t contended;      // Could not proceed immediately
+    uint64_t spun;           // Contended, but acquired by spinning without sleeping
+    uint64_t sleeps;         // Blocked on the wait queue
+    uint64_t wait_cycles;    // TSC cycles spent contended
+} lock_contention_t;
+
 typedef struct mutex {
-    spinlock_t lock; // Spinlock in order to ensure that the atomic operations on the mutex itself are thread-safe
-    bool locked;// This is for checking if the mutex is currrently being held or not
-    struct task* owner;//The task that currently holds the lock
-    struct task* wait_queue;//A linked list of tasks waiting for the lock.
+    spinlock_t lock;                 // Protects the fields below
+    volatile bool locked;
+    struct task* volatile owner;     // Holder; set by unlock when it hands off
+    wait_queue_t waiters;
+    lock_contention_t stats;
 } mutex_t;
-//Function prototypes for the mutexes operations we would be defining
+
 void mutex_init(mutex_t* mutex);
 void mutex_lock(mutex_t* mutex);
+bool mutex_trylock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+typedef struct {
+    spinlock_t lock;
+    int32_t count;
+    wait_queue_t waiters;
+    lock_contention_t stats;
+} semaphore_t;
+
+void sem_init(semaphore_t* sem, int32_t count);
+void sem_down(semaphore_t* sem);
+bool sem_trydown(semaphore_t* sem);
+void sem_up(semaphore_t* sem);
+
+typedef struct {
+    spinlock_t lock;
+    wait_queue_t waiters;
+    lock_contention_t stats;
+} condvar_t;
+
+void cond_init(condvar_t* cv);
+void cond_wait(condvar_t* cv, mutex_t* mutex);
+void cond_signal(condvar_t* cv);
+void cond_broadcast(condvar_t* cv);
+
+void sync_stats_register(const char* name, lock_contention_t* stats);
+void sync_stats_print(void);
+void sync_selftest(void);
+
 // ==========================================
 // 22. BOOTPARAM.H (Linux-style Boot Parameters)
 // ==========================================
@@ -550,4 +968,32 @@ struct boot_params {
 };
 typedef struct boot_params BootParams;
 
+// ==========================================
+// 23. SMP.H (ACPI MADT, Local APIC, IPIs)
+// ==========================================
+#define AP_TRAMPOLINE_BASE 0x7000      // SIPI vector 0x07
+
+#define LAPIC_TIMER_VECTOR  0xF0
+#define RESCHED_VECTOR      0xF1
+#define TLB_FLUSH_VECTOR    0xF2
+#define STOP_VECTOR         0xF4
+#define SPURIOUS_VECTOR     0xFF
+
+void smp_init(void);
+void lapic_eoi(void);
+void smp_send_reschedule(uint32_t cpu);
+void smp_tlb_shootdown(void);
+void smp_stop_others(void);
+void smp_resume_others(void);
+void smp_print_cpus(void);
+
+// ==========================================
+// 24. FPU.H (Lazy FPU/SSE/AVX state)
+// ==========================================
+void fpu_init(void);
+void fpu_init_cpu(void);
+void fpu_switch_out(struct task* prev);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
 #endif
\ No newline at end of file
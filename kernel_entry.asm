@@ -80,4 +80,91 @@ gdt64_start:
 gdt64_end:
 gdt64_descriptor:
     dw gdt64_end - gdt64_start - 1
-    dq gdt64_start
\ No newline at end of file
+    dq gdt64_start
+
+; --- AP trampoline ---
+; smp_init copies this blob to AP_TRAMPOLINE_BASE and starts each AP on it
+; with a SIPI. It runs at that address, not where it was linked, so every
+; absolute reference goes through TADDR. The ap_boot_* slots are filled in
+; by smp_init before each SIPI.
+%define AP_TRAMPOLINE_BASE 0x7000
+%define TADDR(x) (AP_TRAMPOLINE_BASE + (x) - ap_trampoline_start)
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_boot_cr3
+global ap_kernel_cr3
+global ap_boot_stack
+global ap_boot_entry
+global ap_boot_cpu
+
+section .data
+[bits 16]
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [TADDR(ap_gdt_descriptor)]
+    mov eax, cr0
+    or eax, 1                       ; Protected mode
+    mov cr0, eax
+    jmp dword 0x08:TADDR(ap_protected)
+
+[bits 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, 1 << 5                  ; PAE
+    mov cr4, eax
+    mov eax, [TADDR(ap_boot_cr3)]   ; Copy of the kernel PML4 below 4 GB
+    mov cr3, eax
+
+    mov ecx, 0xC0000080             ; EFER.LME
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31                 ; Paging
+    mov cr0, eax
+    jmp 0x18:TADDR(ap_long_mode)
+
+[bits 64]
+ap_long_mode:
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov rax, [TADDR(ap_kernel_cr3)] ; The real PML4 may live above 4 GB
+    mov cr3, rax
+    mov rsp, [TADDR(ap_boot_stack)]
+    mov rdi, [TADDR(ap_boot_cpu)]
+    mov rax, [TADDR(ap_boot_entry)]
+    call rax                        ; ap_main never returns
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+align 8
+ap_gdt:
+    dq 0x0000000000000000
+    dq 0x00CF9A000000FFFF           ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF           ; 0x10: data
+    dq 0x0020980000000000           ; 0x18: 64-bit code
+ap_gdt_descriptor:
+    dw ap_gdt_descriptor - ap_gdt - 1
+    dd TADDR(ap_gdt)
+
+align 8
+ap_boot_cr3:    dq 0
+ap_kernel_cr3:  dq 0
+ap_boot_stack:  dq 0
+ap_boot_entry:  dq 0
+ap_boot_cpu:    dq 0
+ap_trampoline_end:
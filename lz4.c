@@ -0,0 +1,158 @@
+// LZ4 block format codec. Self-contained: it needs only memcpy/memset, so
+// the kernel links it as is and lz4_test.c builds it on the host.
+#include "lz4.h"
+#include <string.h>
+
+#define LZ4_HASH_LOG       12
+#define LZ4_MIN_MATCH      4
+#define LZ4_MFLIMIT        12   // The last match must start this far from the end
+#define LZ4_LAST_LITERALS  5    // The block always ends with this many literals
+#define LZ4_MAX_OFFSET     65535
+
+static inline uint32_t lz4_read32(const uint8_t* p) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, sizeof(v)); // Unaligned load, inlined even with -fno-builtin
+    return v;
+}
+
+static inline void lz4_copy8(uint8_t* dst, const uint8_t* src) {
+    __builtin_memcpy(dst, src, 8);
+}
+
+static inline uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Writes a length continuation (the part above 15) as 255-byte runs.
+static inline uint8_t* lz4_write_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emits literals [anchor, anchor+lit) and, if match_len is non-zero, a match.
+// Returns NULL if the output would exceed oend.
+static uint8_t* lz4_emit(uint8_t* op, uint8_t* oend, const uint8_t* anchor, size_t lit,
+                         size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+    size_t need = 1 + lit + (lit >= 15 ? lit / 255 + 1 : 0) + (match_len ? 2 + (ml >= 15 ? ml / 255 + 1 : 0) : 0);
+    if (need > (size_t)(oend - op)) return NULL;
+
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz4_write_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (!match_len) return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) op = lz4_write_length(op, ml - 15);
+    return op;
+}
+
+// Compresses src (at most 64 KB) into dst. Returns the compressed size, or 0
+// if it does not fit in dst_cap. workspace must hold LZ4_WORKSPACE_SIZE bytes.
+int lz4_compress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap, void* workspace) {
+    uint16_t* table = (uint16_t*)workspace;
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_cap;
+    if (src_len < 0 || src_len > 65536) return 0;
+    memset(table, 0, LZ4_WORKSPACE_SIZE);
+
+    if (src_len > LZ4_MFLIMIT) {
+        const uint8_t* mflimit = iend - LZ4_MFLIMIT;
+        const uint8_t* matchlimit = iend - LZ4_LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+                // Skip ahead faster the longer nothing has matched
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            const uint8_t* mp = ip + LZ4_MIN_MATCH;
+            const uint8_t* rp = ref + LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = lz4_emit(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+            if (!op) return 0;
+            ip = anchor = mp;
+        }
+    }
+    op = lz4_emit(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+// Decompresses a block. Returns the output size, or -1 if the input is
+// malformed or would overflow dst.
+int lz4_decompress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        // Short runs: two unconditional 8-byte copies when both sides have slack
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            lz4_copy8(op, ip);
+            lz4_copy8(op + 8, ip + 8);
+        } else {
+            memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // Final sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        size_t ml = token & 15;
+        if (ml == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                ml += b;
+            } while (b == 255);
+        }
+        ml += LZ4_MIN_MATCH;
+        if (ml > (size_t)(oend - op)) return -1;
+
+        const uint8_t* match = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= ml + 8) {
+            // Chunks never read bytes they have not already written
+            for (size_t i = 0; i < ml; i += 8) lz4_copy8(op + i, match + i);
+            op += ml;
+        } else if (offset >= ml) {
+            memcpy(op, match, ml);
+            op += ml;
+        } else {
+            while (ml--) *op++ = *match++; // Overlapping run, e.g. RLE
+        }
+    }
+    return (int)(op - dst);
+}
@@ -0,0 +1,12 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// LZ4 block codec (freestanding; also builds on the host)
+#define LZ4_WORKSPACE_SIZE (4096 * sizeof(uint16_t))
+int lz4_compress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap, void* workspace);
+int lz4_decompress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap);
+
+#endif
@@ -0,0 +1,115 @@
+// Host round-trip test and throughput benchmark for lz4.c.
+// Build and run with `make lz4-test`.
+#include "lz4.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK 4096              // zram compresses one page at a time
+#define BENCH_BYTES (64u << 20)  // Per sample per direction
+
+static uint8_t workspace[LZ4_WORKSPACE_SIZE];
+static int failures = 0;
+
+static uint32_t rng_state = 12345;
+static uint32_t rng(void) {
+    rng_state = rng_state * 1103515245u + 12345u;
+    return rng_state >> 16;
+}
+
+static void fill_zero(uint8_t* p, int n) { memset(p, 0, n); }
+static void fill_random(uint8_t* p, int n) { for (int i = 0; i < n; i++) p[i] = (uint8_t)rng(); }
+static void fill_text(uint8_t* p, int n) {
+    static const char* words[] = { "page ", "frame ", "zone ", "buddy ", "slab ", "the ", "of ", "lock\n" };
+    int i = 0;
+    while (i < n) {
+        const char* w = words[rng() % 8];
+        while (*w && i < n) p[i++] = (uint8_t)*w++;
+    }
+}
+static void fill_runs(uint8_t* p, int n) {
+    int i = 0;
+    while (i < n) {
+        uint8_t b = (uint8_t)rng();
+        int len = 1 + rng() % 40;
+        while (len-- && i < n) p[i++] = b;
+    }
+}
+// Mostly zero with a few live words, like a sparsely used kernel page
+static void fill_sparse(uint8_t* p, int n) {
+    memset(p, 0, n);
+    for (int i = 0; i < n; i += 64 + rng() % 256) p[i] = (uint8_t)rng();
+}
+
+static const struct {
+    const char* name;
+    void (*fill)(uint8_t*, int);
+} samples[] = {
+    { "zero", fill_zero }, { "sparse", fill_sparse }, { "text", fill_text },
+    { "runs", fill_runs }, { "random", fill_random },
+};
+#define NR_SAMPLES (int)(sizeof(samples) / sizeof(samples[0]))
+
+static void check(int ok, const char* what, const char* sample, int len) {
+    if (ok) return;
+    printf("FAIL: %s (%s, %d bytes)\n", what, sample, len);
+    failures++;
+}
+
+static void round_trip(const char* name, const uint8_t* src, int len) {
+    static uint8_t comp[65536 + 65536 / 255 + 16], out[65536];
+    int clen = lz4_compress(src, len, comp, sizeof(comp), workspace);
+    check(clen > 0, "compress", name, len);
+    if (clen <= 0) return;
+    check(lz4_decompress(comp, clen, out, len) == len, "decompress size", name, len);
+    check(memcmp(src, out, len) == 0, "decompress data", name, len);
+    // A destination one byte short and truncated input must both be rejected
+    if (len > 0) check(lz4_decompress(comp, clen, out, len - 1) < 0, "short dst", name, len);
+    if (clen > 1) check(lz4_decompress(comp, clen - 1, out, len) != len, "truncated src", name, len);
+    // zram's cap: too small an output buffer reports 0, never overflows
+    if (len == BLOCK) {
+        int small = lz4_compress(src, len, comp, clen - 1, workspace);
+        check(small == 0, "compress into short dst", name, len);
+    }
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char* name, const uint8_t* src) {
+    static uint8_t comp[BLOCK * 2], out[BLOCK];
+    int clen = 0;
+    unsigned iters = BENCH_BYTES / BLOCK;
+    double t0 = seconds();
+    for (unsigned i = 0; i < iters; i++) clen = lz4_compress(src, BLOCK, comp, sizeof(comp), workspace);
+    double t1 = seconds();
+    for (unsigned i = 0; i < iters; i++) lz4_decompress(comp, clen, out, BLOCK);
+    double t2 = seconds();
+    double mb = (double)iters * BLOCK / (1 << 20);
+    printf("  %-7s ratio %5.2f  compress %7.0f MB/s  decompress %7.0f MB/s\n",
+           name, (double)BLOCK / clen, mb / (t1 - t0), mb / (t2 - t1));
+}
+
+int main(void) {
+    static const int lengths[] = { 0, 1, 5, 12, 13, 100, 255, 1000, BLOCK, 65536 };
+    static uint8_t buf[65536];
+    for (int s = 0; s < NR_SAMPLES; s++) {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            samples[s].fill(buf, lengths[l]);
+            round_trip(samples[s].name, buf, lengths[l]);
+        }
+    }
+    check(lz4_compress(buf, 65537, buf, sizeof(buf), workspace) == 0, "oversized input", "-", 65537);
+    printf("lz4: round trips %s\n", failures ? "FAILED" : "ok");
+
+    printf("lz4: %d-byte blocks\n", BLOCK);
+    for (int s = 0; s < NR_SAMPLES; s++) {
+        samples[s].fill(buf, BLOCK);
+        bench(samples[s].name, buf);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+// String move and fill variants for x86_64. Self-contained so that the
+// kernel links it as is and memops_test.c benchmarks it on the host.
+#include "memops.h"
+
+void* memcpy_movsq(void* dest, const void* src, size_t num) {
+    void* d = dest;
+    const void* s = src;
+    size_t qwords = num >> 3, bytes = num & 7;
+    __asm__ __volatile__("rep movsq" : "+D"(d), "+S"(s), "+c"(qwords) : : "memory");
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(s), "+c"(bytes) : : "memory");
+    return dest;
+}
+
+// ERMS: microcoded rep movsb/stosb moves whole cache lines
+void* memcpy_erms(void* dest, const void* src, size_t num) {
+    void* d = dest;
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(src), "+c"(num) : : "memory");
+    return dest;
+}
+
+void* memset_stosq(void* ptr, int value, size_t num) {
+    void* d = ptr;
+    uint64_t pattern = (uint8_t)value * 0x0101010101010101ULL;
+    size_t qwords = num >> 3, bytes = num & 7;
+    __asm__ __volatile__("rep stosq" : "+D"(d), "+c"(qwords) : "a"(pattern) : "memory");
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(bytes) : "a"(pattern) : "memory");
+    return ptr;
+}
+
+void* memset_erms(void* ptr, int value, size_t num) {
+    void* d = ptr;
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(num) : "a"(value) : "memory");
+    return ptr;
+}
+
+// SSE2 non-temporal stores for copies much larger than the cache. MOVNTI
+// streams from general registers, so no XMM state has to be saved.
+static inline void movnti64(uint64_t* p, uint64_t v) {
+    __asm__ __volatile__("movnti %1, %0" : "=m"(*p) : "r"(v));
+}
+
+void* memcpy_nt(void* dest, const void* src, size_t num) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    size_t head = (8 - ((uintptr_t)d & 7)) & 7;
+    if (head > num) head = num;
+    memcpy_movsq(d, s, head);
+    d += head; s += head; num -= head;
+    for (; num >= 32; num -= 32, d += 32, s += 32) {
+        const uint64_t* s64 = (const uint64_t*)s;
+        uint64_t a = s64[0], b = s64[1], c = s64[2], e = s64[3];
+        movnti64((uint64_t*)d, a);
+        movnti64((uint64_t*)d + 1, b);
+        movnti64((uint64_t*)d + 2, c);
+        movnti64((uint64_t*)d + 3, e);
+    }
+    __asm__ __volatile__("sfence" : : : "memory"); // Order the streamed stores
+    memcpy_movsq(d, s, num);
+    return dest;
+}
+
+void* memset_nt(void* ptr, int value, size_t num) {
+    uint8_t* d = (uint8_t*)ptr;
+    uint64_t pattern = (uint8_t)value * 0x0101010101010101ULL;
+    size_t head = (8 - ((uintptr_t)d & 7)) & 7;
+    if (head > num) head = num;
+    memset_stosq(d, value, head);
+    d += head; num -= head;
+    for (; num >= 32; num -= 32, d += 32) {
+        movnti64((uint64_t*)d, pattern);
+        movnti64((uint64_t*)d + 1, pattern);
+        movnti64((uint64_t*)d + 2, pattern);
+        movnti64((uint64_t*)d + 3, pattern);
+    }
+    __asm__ __volatile__("sfence" : : : "memory");
+    memset_stosq(d, value, num);
+    return ptr;
+}
+
+// Copies from the end down, for memmove with dest above an overlapping src.
+// Keep GCC from turning the loop back into a memmove call.
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void* memcpy_backward(void* dest, const void* src, size_t num) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    while (num >= 8) {
+        num -= 8;
+        uint64_t v;
+        __builtin_memcpy(&v, s + num, 8);
+        __builtin_memcpy(d + num, &v, 8);
+    }
+    while (num--) d[num] = s[num];
+    return dest;
+}
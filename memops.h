@@ -0,0 +1,19 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// memcpy/memset variants behind the kernel's CPUID dispatch (freestanding;
+// also builds on the host for memops_test.c)
+#define MEMOPS_NT_THRESHOLD (1024 * 1024)  // Larger copies bypass the cache
+
+void* memcpy_movsq(void* dest, const void* src, size_t num);   // Any x86_64
+void* memcpy_erms(void* dest, const void* src, size_t num);    // CPUID.7:EBX.ERMS
+void* memcpy_nt(void* dest, const void* src, size_t num);      // SSE2
+void* memcpy_backward(void* dest, const void* src, size_t num);
+void* memset_stosq(void* ptr, int value, size_t num);
+void* memset_erms(void* ptr, int value, size_t num);
+void* memset_nt(void* ptr, int value, size_t num);
+
+#endif
@@ -0,0 +1,126 @@
+// Host correctness test and bytes-per-cycle benchmark for memops.c.
+// Build and run with `make membench`.
+#include "memops.h"
+#include <cpuid.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SIZE (8u << 20)
+#define BENCH_BYTES (64u << 20)  // Per sample, at least one call
+
+static int failures = 0;
+
+typedef void* (*copy_fn)(void*, const void*, size_t);
+typedef void* (*fill_fn)(void*, int, size_t);
+
+static const struct { const char* name; copy_fn fn; } copies[] = {
+    { "movsq", memcpy_movsq }, { "erms", memcpy_erms }, { "nt", memcpy_nt }, { "libc", memcpy },
+};
+static const struct { const char* name; fill_fn fn; } fills[] = {
+    { "stosq", memset_stosq }, { "erms", memset_erms }, { "nt", memset_nt }, { "libc", memset },
+};
+#define NR_VARIANTS 4
+
+static void check(int ok, const char* what, const char* name, size_t len, size_t align) {
+    if (ok) return;
+    printf("FAIL: %s %s (%zu bytes, offset %zu)\n", what, name, len, align);
+    failures++;
+}
+
+static uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Every variant must touch exactly [off, off + len) with the right bytes
+static void test_variants(uint8_t* src, uint8_t* dst, uint8_t* ref) {
+    static const size_t lengths[] = { 0, 1, 7, 8, 9, 31, 32, 33, 100, 4096, 65537 };
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t len = lengths[l];
+        for (size_t off = 0; off < 8; off++) {
+            for (int v = 0; v < NR_VARIANTS; v++) {
+                memset(dst, 0xEE, len + 16);
+                memcpy(ref, dst, len + 16);
+                memcpy(ref + off, src + 3, len);
+                copies[v].fn(dst + off, src + 3, len);
+                check(memcmp(dst, ref, len + 16) == 0, "memcpy", copies[v].name, len, off);
+
+                memset(dst, 0xEE, len + 16);
+                memset(ref, 0xEE, len + 16);
+                for (size_t i = 0; i < len; i++) ref[off + i] = 0xA5;
+                fills[v].fn(dst + off, 0x1A5, len);   // Only the low byte counts
+                check(memcmp(dst, ref, len + 16) == 0, "memset", fills[v].name, len, off);
+            }
+            // memmove's overlapping case: dest above src within the same buffer
+            for (size_t i = 0; i < len + 16; i++) dst[i] = ref[i] = (uint8_t)(i * 7);
+            for (size_t i = len; i-- > 0;) ref[off + 1 + i] = ref[i];
+            memcpy_backward(dst + off + 1, dst, len);
+            check(memcmp(dst, ref, len + 16) == 0, "overlap", "backward", len, off);
+        }
+    }
+}
+
+static double bytes_per_cycle(size_t size, uint64_t cycles, size_t iters) {
+    return (double)size * iters / (cycles ? cycles : 1);
+}
+
+// Best of three, so a stray interrupt doesn't skew a row
+static uint64_t time_copy(copy_fn fn, uint8_t* dst, const uint8_t* src, size_t size, size_t iters) {
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < 3; run++) {
+        uint64_t t0 = rdtsc();
+        for (size_t i = 0; i < iters; i++) fn(dst, src, size);
+        uint64_t t = rdtsc() - t0;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+static uint64_t time_fill(fill_fn fn, uint8_t* dst, size_t size, size_t iters) {
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < 3; run++) {
+        uint64_t t0 = rdtsc();
+        for (size_t i = 0; i < iters; i++) fn(dst, (int)i, size);
+        uint64_t t = rdtsc() - t0;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+int main(void) {
+    uint8_t* src = malloc(MAX_SIZE + 64);
+    uint8_t* dst = malloc(MAX_SIZE + 64);
+    uint8_t* ref = malloc(MAX_SIZE + 64);
+    if (!src || !dst || !ref) {
+        printf("memops: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < MAX_SIZE + 64; i++) src[i] = (uint8_t)(i * 31 + 7);
+
+    test_variants(src, dst, ref);
+    printf("memops: variants %s\n", failures ? "FAILED" : "ok");
+
+    unsigned eax, ebx, ecx, edx;
+    int erms = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && ((ebx >> 9) & 1);
+    printf("memops: bytes per cycle (TSC), ERMS %s\n", erms ? "yes" : "no");
+    printf("%-8s", "size");
+    for (int v = 0; v < NR_VARIANTS; v++) printf(" cpy-%-6s", copies[v].name);
+    for (int v = 0; v < NR_VARIANTS; v++) printf(" set-%-6s", fills[v].name);
+    printf("\n");
+    for (size_t size = 8; size <= MAX_SIZE; size *= 4) {
+        size_t iters = BENCH_BYTES / size;
+        if (iters == 0) iters = 1;
+        printf("%-8zu", size);
+        for (int v = 0; v < NR_VARIANTS; v++)
+            printf(" %10.2f", bytes_per_cycle(size, time_copy(copies[v].fn, dst, src, size, iters), iters));
+        for (int v = 0; v < NR_VARIANTS; v++)
+            printf(" %10.2f", bytes_per_cycle(size, time_fill(fills[v].fn, dst, size, iters), iters));
+        printf("\n");
+    }
+    free(src);
+    free(dst);
+    free(ref);
+    return failures ? 1 : 0;
+}